@@ -1,20 +1,39 @@
+// The host passes its configuration as -D options (specialize_kernels()),
+// these defaults only apply when the file is built on its own
+
 // These are used to decide the window size
-#define WINDOW_HEIGHT 1024 
+#ifndef WINDOW_HEIGHT
+#define WINDOW_HEIGHT 1024
+#endif
+#ifndef WINDOW_WIDTH
 #define WINDOW_WIDTH 1024
+#endif
 
 // The number of satelites can be changed to see how it affects performance.
 // Benchmarks must be run with the original number of satellites
+#ifndef SATELITE_COUNT
 #define SATELITE_COUNT 64
+#endif
 
 // These are used to control the satelite movement
+#ifndef SATELITE_RADIUS
 #define SATELITE_RADIUS 3.16f
+#endif
+#ifndef MAX_VELOCITY
 #define MAX_VELOCITY 0.1f
+#endif
+#ifndef GRAVITY
 #define GRAVITY 1.0f
+#endif
+#ifndef DELTATIME
 #define DELTATIME 32
+#endif
+#ifndef PHYSICSUPDATESPERFRAME
 #define PHYSICSUPDATESPERFRAME 100000
+#endif
 
 // Some helpers to window size variables
-#define SIZE WINDOW_HEIGHT*WINDOW_HEIGHT
+#define SIZE (WINDOW_WIDTH * WINDOW_HEIGHT)
 #define HORIZONTAL_CENTER (WINDOW_WIDTH / 2)
 #define VERTICAL_CENTER (WINDOW_HEIGHT / 2)
 
@@ -105,7 +124,24 @@ __kernel void parallelPhysicsEngineKernel(__global satelite* satelites)
 }
 
 
-__kernel void parallelGraphicsEngineKernel(__global satelite* satelites, __global color* pixels){
+#ifdef IMAGE_OUTPUT
+// The frame is an RGBA image in the format the host chose (RGBA8 or
+// RGBA16F), the device packs and lays out the pixels
+#define PIXELS_PARAMETER __write_only image2d_t pixels
+#define STORE_PIXEL(x, y, c) write_imagef(pixels, (int2)((x), (y)), \
+					(float4)((c).red, (c).green, (c).blue, 1.0f))
+#else
+#define PIXELS_PARAMETER __global color* pixels
+#define STORE_PIXEL(x, y, c) (pixels[(x) + WINDOW_WIDTH * (y)] = (c))
+#endif
+
+#ifdef VORONOI_MAP
+// nearest is the closest satelite map of the jump flooding kernels below
+__kernel void parallelGraphicsEngineKernel(__global satelite* satelites, PIXELS_PARAMETER,
+					__global const int* nearest){
+#else
+__kernel void parallelGraphicsEngineKernel(__global satelite* satelites, PIXELS_PARAMETER){
+#endif
 
 
 	 size_t id_x = get_global_id(1);
@@ -120,6 +156,33 @@ __kernel void parallelGraphicsEngineKernel(__global satelite* satelites, __globa
 	__private color incrementColor = { .red = 0.f, .green = 0.f, .blue = 0.f};
 
 
+#ifdef FAST_COLOR
+	// Squared distances only, one square root per pixel instead of one per
+	// satelite. sqrt is monotonic, so the closest satelite and the hit
+	// test match.
+	float shortestDistance2 = INFINITY;
+	float weights = 0.f;
+
+	for(int j = 0; j < SATELITE_COUNT; ++j) {
+		float dx = pixel.x - satelites[j].position.x;
+		float dy = pixel.y - satelites[j].position.y;
+		float dist2 = dx * dx + dy * dy;
+		float weight = native_recip(dist2 * dist2);
+		weights += weight;
+
+#ifndef VORONOI_MAP
+		if (dist2 < shortestDistance2){
+		   shortestDistance2 = dist2;
+		   renderColor = satelites[j].identifier;
+		}
+#endif
+
+		incrementColor.red += satelites[j].identifier.red * weight;
+		incrementColor.green += satelites[j].identifier.green * weight;
+		incrementColor.blue += satelites[j].identifier.blue * weight;
+	}
+	float shortestDistance = sqrt(shortestDistance2);
+#else
 	// Find closest satelite
 	float shortestDistance = INFINITY;
 
@@ -139,26 +202,42 @@ __kernel void parallelGraphicsEngineKernel(__global satelite* satelites, __globa
 		weights += weight;
 	
 		
+#ifndef VORONOI_MAP
 		if (distance < shortestDistance){
 		   shortestDistance = distance;
 		   renderColor = satelites[j].identifier;
 		}
+#endif
 
 		incrementColor.red += satelites[j].identifier.red * weight;
 		incrementColor.green += satelites[j].identifier.green * weight;
         	incrementColor.blue += satelites[j].identifier.blue * weight;
         
     	}
+#endif
+
+#ifdef VORONOI_MAP
+	// The closest satelite is looked up, only its distance is needed
+	int closest = nearest[id_x + WINDOW_WIDTH * id_y];
+	floatvector closestDifference = {.x = pixel.x - satelites[closest].position.x,
+					.y = pixel.y - satelites[closest].position.y};
+	shortestDistance = sqrt(closestDifference.x * closestDifference.x +
+				closestDifference.y * closestDifference.y);
+	renderColor = satelites[closest].identifier;
+#endif
 						
 	
    	// Calculate the color based on distance to every satelite.
+#ifndef STAMP_DISCS
 	if(shortestDistance < SATELITE_RADIUS) {
 
 		    renderColor.red = 1.0f;
 		    renderColor.green = 1.0f;
 		    renderColor.blue = 1.0f;
 
-	}else {
+	}else
+#endif
+	{
 	            
         	    renderColor.red   += incrementColor.red / weights * 3.0f;                                                      
         	    renderColor.green += incrementColor.green / weights * 3.0f;             	 
@@ -167,6 +246,170 @@ __kernel void parallelGraphicsEngineKernel(__global satelite* satelites, __globa
 
 
 
-	pixels[id_x + WINDOW_WIDTH * id_y] = renderColor;
+	STORE_PIXEL(id_x, id_y, renderColor);
+
+}
+
+
+// Pixels of the bounding box of a satelite disc in each direction
+#define STAMP_BOX 8
+
+// Draws the white satelite discs after parallelGraphicsEngineKernel was
+// built with STAMP_DISCS. Global size is SATELITE_COUNT x STAMP_BOX^2, one
+// work item per pixel of a disc's bounding box.
+__kernel void stampSatelitesKernel(__global satelite* satelites, PIXELS_PARAMETER){
+
+	size_t j = get_global_id(0);
+	size_t k = get_global_id(1);
+
+	floatvector position = satelites[j].position;
+	int x = (int)floor(position.x - SATELITE_RADIUS) + (int)(k % STAMP_BOX);
+	int y = (int)floor(position.y - SATELITE_RADIUS) + (int)(k / STAMP_BOX);
+	if(x < 0 || x >= WINDOW_WIDTH || y < 0 || y >= WINDOW_HEIGHT){
+		return;
+	}
+
+	floatvector difference = {.x = x - position.x, .y = y - position.y};
+	float distance = sqrt(difference.x * difference.x +
+						difference.y * difference.y);
+	if(distance < SATELITE_RADIUS){
+		color white = {.red = 1.0f, .green = 1.0f, .blue = 1.0f};
+		STORE_PIXEL(x, y, white);
+	}
+}
+
+
+// Jump flooding map of the closest satelite of every pixel, see
+// buildVoronoiMap() in OpenMP/parallel1.c. voronoiClearKernel and
+// voronoiStepKernel run over the window like the graphics kernel,
+// voronoiSeedKernel over the satelites.
+__kernel void voronoiClearKernel(__global int* map){
+
+	map[get_global_id(1) + WINDOW_WIDTH * get_global_id(0)] = -1;
+}
+
+// Every satelite takes its pixel, or a free one next to it
+__kernel void voronoiSeedKernel(__global satelite* satelites, __global int* map){
+
+	int j = get_global_id(0);
+	int x = (int)clamp(rint(satelites[j].position.x), 0.f, (float)(WINDOW_WIDTH - 1));
+	int y = (int)clamp(rint(satelites[j].position.y), 0.f, (float)(WINDOW_HEIGHT - 1));
+	for(int ring = 0; ring <= 3; ++ring){
+		for(int dy = -ring; dy <= ring; ++dy){
+			for(int dx = -ring; dx <= ring; ++dx){
+				int nx = x + dx;
+				int ny = y + dy;
+				if(nx >= 0 && nx < WINDOW_WIDTH && ny >= 0 && ny < WINDOW_HEIGHT &&
+				   atomic_cmpxchg(&map[nx + WINDOW_WIDTH * ny], -1, j) == -1){
+					return;
+				}
+			}
+		}
+	}
+}
+
+// One pass: the closest of the satelites seen at +-step, ties to the lower index
+__kernel void voronoiStepKernel(__global satelite* satelites, __global const int* source,
+				__global int* target, int step){
+
+	int id_x = get_global_id(1);
+	int id_y = get_global_id(0);
+	floatvector pixel = {.x = id_x, .y = id_y};
+	int best = -1;
+	float shortestDistance = INFINITY;
+
+	for(int dy = -1; dy <= 1; ++dy){
+		int ny = clamp(id_y + dy * step, 0, WINDOW_HEIGHT - 1);
+		for(int dx = -1; dx <= 1; ++dx){
+			int nx = clamp(id_x + dx * step, 0, WINDOW_WIDTH - 1);
+			int j = source[nx + WINDOW_WIDTH * ny];
+			if(j < 0 || j == best){
+				continue;
+			}
+			floatvector difference = {.x = pixel.x - satelites[j].position.x,
+						.y = pixel.y - satelites[j].position.y};
+			float distance = sqrt(difference.x * difference.x +
+					difference.y * difference.y);
+			if(distance < shortestDistance || (distance == shortestDistance && j < best)){
+				shortestDistance = distance;
+				best = j;
+			}
+		}
+	}
+	target[id_x + WINDOW_WIDTH * id_y] = best;
+}
+
+// Jump flooding is not exact, the map is repaired like voronoiRepair() in
+// OpenMP/parallel1.c. voronoiMarkKernel marks the pixels without a
+// satelite, with a neighbor of another one or on the border and clears
+// the next marks, voronoiMarkSeedsKernel marks the pixels around every
+// satelite.
+__kernel void voronoiMarkKernel(__global const int* map, __global uchar* check,
+				__global uchar* next){
+
+	int id_x = get_global_id(1);
+	int id_y = get_global_id(0);
+	int j = map[id_x + WINDOW_WIDTH * id_y];
+	int mark = j < 0 || id_x == 0 || id_y == 0 ||
+		id_x == WINDOW_WIDTH - 1 || id_y == WINDOW_HEIGHT - 1;
+	for(int ny = id_y - 1; ny <= id_y + 1 && !mark; ++ny){
+		for(int nx = id_x - 1; nx <= id_x + 1 && !mark; ++nx){
+			mark = map[nx + WINDOW_WIDTH * ny] != j;
+		}
+	}
+	check[id_x + WINDOW_WIDTH * id_y] = mark;
+	next[id_x + WINDOW_WIDTH * id_y] = 0;
+}
+
+__kernel void voronoiMarkSeedsKernel(__global satelite* satelites, __global uchar* check){
 
+	int j = get_global_id(0);
+	int x = (int)clamp(rint(satelites[j].position.x), 0.f, (float)(WINDOW_WIDTH - 1));
+	int y = (int)clamp(rint(satelites[j].position.y), 0.f, (float)(WINDOW_HEIGHT - 1));
+	for(int ny = max(y - 1, 0); ny <= min(y + 1, WINDOW_HEIGHT - 1); ++ny){
+		for(int nx = max(x - 1, 0); nx <= min(x + 1, WINDOW_WIDTH - 1); ++nx){
+			check[nx + WINDOW_WIDTH * ny] = 1;
+		}
+	}
+}
+
+// One round: the marked pixels search all satelites like the color
+// kernel, the ones that change mark their neighbors in next and set
+// changed. The marks are cleared as they are read, so check is clear for
+// the round it is next.
+__kernel void voronoiRepairKernel(__global satelite* satelites, __global int* map,
+				__global uchar* check, __global uchar* next,
+				__global int* changed){
+
+	int id_x = get_global_id(1);
+	int id_y = get_global_id(0);
+	int i = id_x + WINDOW_WIDTH * id_y;
+	if(!check[i]){
+		return;
+	}
+	check[i] = 0;
+
+	floatvector pixel = {.x = id_x, .y = id_y};
+	float shortestDistance = INFINITY;
+	int best = 0;
+	for(int j = 0; j < SATELITE_COUNT; ++j){
+		floatvector difference = {.x = pixel.x - satelites[j].position.x,
+					.y = pixel.y - satelites[j].position.y};
+		float distance = sqrt(difference.x * difference.x +
+				difference.y * difference.y);
+		if(distance < shortestDistance){
+			shortestDistance = distance;
+			best = j;
+		}
+	}
+	if(best == map[i]){
+		return;
+	}
+	map[i] = best;
+	*changed = 1;
+	for(int ny = max(id_y - 1, 0); ny <= min(id_y + 1, WINDOW_HEIGHT - 1); ++ny){
+		for(int nx = max(id_x - 1, 0); nx <= min(id_x + 1, WINDOW_WIDTH - 1); ++nx){
+			next[nx + WINDOW_WIDTH * ny] = 1;
+		}
+	}
 }
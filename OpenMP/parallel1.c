@@ -21,8 +21,33 @@ VERSION 20.0 - relax physic correctness check
 // no optimization:   gcc -o parallel parallel.c -std=c99 -framework GLUT -framework OpenGL
 // most optimization: gcc -o parallel parallel.c -std=c99 -framework GLUT -framework OpenGL -O3
 
-
-
+// Batch runs without a window:
+// ensemble of 100 seeds, 10 frames each: ./parallel 1 --ensemble=100 --frames=10 --output=out
+// Frame recording (needs -pthread):
+// every frame to a video: ./parallel 1 --record=run.y4m [--record-queue=4] [--record-drop]
+// (run.rgb gives raw rgb24 frames, run%06u.ppm a PPM sequence)
+// Validation: --validate=full|sample[:N]|off, --validate-every=N, --validate-strict (exit on failure)
+// Instrumentation: --trace=trace.json (Chrome trace events + histograms at exit), --trace-summary (histograms only)
+// Color pass: --color=exact (default)|fast|half, see shadePixelFast()
+// Disc stamping: --stamp renders without hit tests, then draws the satelite discs in a second pass
+// Closest satelite: --voronoi=search (default)|jfa, jfa takes it from a jump flooding map repaired to the exact one instead of searching per pixel
+// Adaptive rendering: --adaptive[=bound] interpolates smooth cells with a per-pixel error of at most bound (default 0.04)
+// Satelite count: --satelites=N (default 64), 16, 64, 256 and 1024 have specialized renderers
+// Precision check: ./parallel 1 --ensemble=100 --frames=10 --color=fast --validate-every=1 (largest error is printed at the end)
+// Scheduling: --sched=omp (default, static OpenMP loops) or --sched=steal (work-stealing tasks, see common/task_sched.h)
+// Memory: --huge-pages=auto (default)|explicit|transparent|off for the frame buffers, --alloc-report
+// NUMA: --numa=first-touch (default)|bind|off places each thread's rows on its node, --pin pins threads, --numa-report
+// Roofline: --roofline[=roofline.csv] rates both engines against the peak FLOP/s and triad bandwidth of this host at exit
+// Frame loop allocations: --check-allocations fails the run if a frame after the first ones allocates memory
+// (malloc and friends made by this program, not by libgomp or other libraries, are only counted when built with
+// -DCOUNT_ALLOCATIONS), --alloc-report also shows the frame arenas. Both of these must pass (exit status 0):
+//   gcc -o parallel parallel1.c -std=c99 -O2 -fopenmp -DCOUNT_ALLOCATIONS -lglut -lGL -lm
+//   OMP_NUM_THREADS=1 ./parallel 1 --ensemble=1 --frames=4 --output=out --check-allocations
+//   OMP_NUM_THREADS=4 ./parallel 1 --ensemble=1 --frames=4 --output=out --check-allocations
+// Hardware counters: --perf (IPC, cache and branch misses per phase and thread), --perf-fp=config[:weight],... (raw FP events)
+
+
+#define _GNU_SOURCE
 #ifdef _WIN32
 #include <windows.h>
 #endif
@@ -30,6 +55,20 @@ VERSION 20.0 - relax physic correctness check
 #include <math.h> // INFINITY
 #include <stdlib.h>
 #include <string.h>
+#include <omp.h>
+
+#include "../common/options.h"
+#include "../common/clock.h"
+#include "../common/image_io.h"
+#include "../common/frame_sink.h"
+#include "../common/validate.h"
+#include "../common/trace.h"
+#include "../common/perf_counters.h"
+#include "../common/task_sched.h"
+#include "../common/alloc.h"
+#include "../common/numa.h"
+#include "../common/frame_arena.h"
+#include "../common/roofline.h"
 
 // Window handling includes
 #ifndef __APPLE__
@@ -45,7 +84,10 @@ VERSION 20.0 - relax physic correctness check
 
 // The number of satelites can be changed to see how it affects performance.
 // Benchmarks must be run with the original number of satellites
-#define SATELITE_COUNT 64
+// It can also be set at run time with --satelites=N, see pickRenderer()
+#define DEFAULT_SATELITE_COUNT 64
+#define SATELITE_COUNT sateliteCount
+int sateliteCount = DEFAULT_SATELITE_COUNT;
 
 // These are used to control the satelite movement
 #define SATELITE_RADIUS 3.16f
@@ -59,9 +101,9 @@ VERSION 20.0 - relax physic correctness check
 #define HORIZONTAL_CENTER (WINDOW_WIDTH / 2)
 #define VERTICAL_CENTER (WINDOW_HEIGHT / 2)
 
-// Is used to find out frame times
-int previousFrameTimeSinceStart = 0;
-int previousFinishTime = 0;
+// Is used to find out frame times (nanoseconds, see common/clock.h)
+uint64_t previousFrameTimeSinceStart = 0;
+uint64_t previousFinishTime = 0;
 unsigned int frameNumber = 0;
 unsigned int seed = 0;
 
@@ -110,13 +152,238 @@ satelite* backupSatelites;
 
 // ## You may add your own variables here ##
 
+// Batch mode settings, filled in by parseArguments()
+unsigned int ensembleSize = 0;   // 0 means the normal interactive window
+unsigned int batchFrames = 1;
+const char* outputDirectory = ".";
+
+// Frame recording settings and the sink of the interactive scene
+const char* recordPath = NULL;
+unsigned int recordQueueDepth = 4;
+int recordDropWhenFull = 0;
+frameSink* recorder = NULL;
+
+// Validation settings, see checkFrame()
+const char* validateMode = "full";
+unsigned int validateEvery = 0;  // 0 checks the first two frames only
+int validateStrict = 0;
+unsigned int validationFailures = 0;
+validator* frameValidator = NULL;
+// Largest pixel error over all validated frames
+double largestError = 0.0;
+unsigned int validatedFrames = 0;
+
+// Chrome trace output, NULL if only histograms were asked for
+const char* tracePath = NULL;
+
+// Prints where the frame buffer pages are and how they are backed at exit
+int numaReportAtExit = 0;
+int allocReportAtExit = 0;
+
+// Allocation check of the frame loop, see frameBoundary()
+#define ALLOCATION_WARMUP_FRAMES 1
+int checkAllocations = 0;
+uint64_t frameAllocations = 0;   // heapAllocationCount() at the frame start
+unsigned int allocatingFrames = 0;
+
+// Work-stealing scheduler, NULL when the OpenMP loops are used
+taskScheduler* scheduler = NULL;
+// Square pixel tiles and satelites per task of the scheduler
+#define TILE_SIZE 32
+#define TILES_PER_ROW (WINDOW_WIDTH / TILE_SIZE)
+#define TILE_COUNT (TILES_PER_ROW * (WINDOW_HEIGHT / TILE_SIZE))
+
+// One independent scene of an ensemble run
+typedef struct{
+   unsigned int seed;
+   satelite* satelites;
+   color* pixels;
+} scene;
+
+// Defined in the fixed part of this file
+void initSatelites(satelite* s);
+void sequentialPixel(const satelite* satelites, int i, color* out);
+#define ALLOWED_FP_ERROR 0.08
+
+// Opens a frame sink for the given path or exits
+frameSink* openRecorder(const char* path, unsigned int expectedFrames){
+   frameSink* sink = frameSinkOpen(path, WINDOW_WIDTH, WINDOW_HEIGHT,
+      expectedFrames, recordQueueDepth, recordDropWhenFull);
+   if(!sink){
+      printf("Could not open frame sink %s\n", path);
+      exit(EXIT_FAILURE);
+   }
+   return sink;
+}
+
+// Validation callback: context is the satelite array of the scene
+static void referencePixel(long pixel, float* out, void* context){
+   sequentialPixel((const satelite*)context, (int)pixel, (color*)out);
+}
+
+// Creates the validator, reference is a frame sized scratch buffer
+validator* createValidator(color* reference){
+   validator* v = validatorCreate(WINDOW_WIDTH, WINDOW_HEIGHT, validateMode,
+      ALLOWED_FP_ERROR, (float*)reference);
+   if(!v){
+      printf("Unknown validation mode %s, use full, sample, sample:N or off\n", validateMode);
+      exit(EXIT_FAILURE);
+   }
+   // Hit and no-hit pixels at the satelite edges are always checked
+   v->hotSpotRadius = SATELITE_RADIUS;
+   return v;
+}
+
+int shouldValidate(unsigned int frame){
+   return frame < 2 || (validateEvery > 0 && frame % validateEvery == 0);
+}
+
+// Called for every failed check. Strict runs (CI) stop with an error.
+void validationFailed(void){
+   validationFailures++;
+   if(validateStrict){
+      printf("Validation failed, exiting.\n");
+      exit(EXIT_FAILURE);
+   }
+}
 
+// Validates frame against the reference renderer of the given satelites.
+// Satelites are hot spots, tiles under them are always checked.
+int checkFrame(const satelite* s, const color* frame, color* reference,
+               unsigned int frameNo, const char* label){
+   if(!frameValidator){
+      frameValidator = createValidator(reference);
+   }
+   frameValidator->reference = (float*)reference;
+   float hotSpots[2 * SATELITE_COUNT];
+   for(int i = 0; i < SATELITE_COUNT; ++i){
+      hotSpots[2 * i] = s[i].position.x;
+      hotSpots[2 * i + 1] = s[i].position.y;
+   }
+   validationReport report = validateFrame(frameValidator, (const float*)frame,
+      frameNo, hotSpots, SATELITE_COUNT, referencePixel, (void*)s);
+   // Frames with nothing compared (--validate=off) do not count as checked
+   if(report.worstPixel >= 0 && report.comparedPixels > 0){
+      validatedFrames++;
+      if(report.maxError > largestError){
+         largestError = report.maxError;
+      }
+   }
+   if(!printValidationReport(&report, WINDOW_WIDTH, ALLOWED_FP_ERROR, label)){
+      validationFailed();
+      return 0;
+   }
+   return 1;
+}
 
+// Summary of a precision check over many frames and seeds
+void printLargestError(void){
+   if(validatedFrames > 0){
+      printf("Largest pixel error over %u validated frames: %.5f (allowed %.3f, %.0f%% of the budget)\n",
+         validatedFrames, largestError, ALLOWED_FP_ERROR,
+         100.0 * largestError / ALLOWED_FP_ERROR);
+   } else {
+      printf("Largest pixel error: no frames were validated\n");
+   }
+}
 
 // ## You may add your own initialization routines here ##
 void init(){
+   if(recordPath && ensembleSize == 0){
+      recorder = openRecorder(recordPath, 0);
+   }
+
+}
+
+// Moves one satelite through all physics updates of a frame.
+// Satelites do not affect each other, so iterating satelite by satelite
+// gives bit-identical results to the sequential update order.
+static void integrateSatelite(satelite* s){
+
+   // double precision required for accumulation inside this routine,
+   // but float storage is ok outside these loops.
+   doublevector tmpPosition = {.x = s->position.x, .y = s->position.y};
+   doublevector tmpVelocity = {.x = s->velocity.x, .y = s->velocity.y};
 
+   // Physics iteration loop
+   for(int physicsUpdateIndex = 0;
+       physicsUpdateIndex < PHYSICSUPDATESPERFRAME;
+      ++physicsUpdateIndex){
+
+      // Distance to the blackhole (bit ugly code because C-struct cannot have member functions)
+      doublevector positionToBlackHole = {.x = tmpPosition.x -
+         HORIZONTAL_CENTER, .y = tmpPosition.y - VERTICAL_CENTER};
+      double distToBlackHoleSquared =
+         positionToBlackHole.x * positionToBlackHole.x +
+         positionToBlackHole.y * positionToBlackHole.y;
+      double distToBlackHole = sqrt(distToBlackHoleSquared);
+
+      // Gravity force
+      doublevector normalizedDirection = {
+         .x = positionToBlackHole.x / distToBlackHole,
+         .y = positionToBlackHole.y / distToBlackHole};
+      double accumulation = GRAVITY / distToBlackHoleSquared;
+
+      // Delta time is used to make velocity same despite different FPS
+      // Update velocity based on force
+      tmpVelocity.x -= accumulation * normalizedDirection.x *
+         DELTATIME / PHYSICSUPDATESPERFRAME;
+      tmpVelocity.y -= accumulation * normalizedDirection.y *
+         DELTATIME / PHYSICSUPDATESPERFRAME;
+
+      // Update position based on velocity
+      tmpPosition.x +=
+         tmpVelocity.x * DELTATIME / PHYSICSUPDATESPERFRAME;
+      tmpPosition.y +=
+         tmpVelocity.y * DELTATIME / PHYSICSUPDATESPERFRAME;
+   }
 
+   // copy back the float storage.
+   s->position.x = tmpPosition.x;
+   s->position.y = tmpPosition.y;
+   s->velocity.x = tmpVelocity.x;
+   s->velocity.y = tmpVelocity.y;
+}
+
+// Scheduler task: a block of satelites
+static void integrateSateliteBlock(void* context, int begin, int end){
+   satelite* s = (satelite*)context;
+   for(int i = begin; i < end; ++i){
+      integrateSatelite(&s[i]);
+   }
+}
+
+// Moves count satelites, which may come from several scenes
+static void integrateSatelites(satelite* s, int count){
+   if(scheduler){
+      // Every satelite costs the same, one per task lets any worker help
+      schedParallelFor(scheduler, count, 1, integrateSateliteBlock, s,
+         TRACE_PHYSICS_THREAD);
+      return;
+   }
+#pragma omp parallel
+   {
+      // Every thread times its own share to show imbalance
+      TRACE_SCOPE(TRACE_PHYSICS_THREAD);
+#pragma omp for schedule(static) nowait
+      for(int i = 0; i < count; ++i){
+         integrateSatelite(&s[i]);
+      }
+   }
+}
+
+// Start of a frame: the scratch of the previous frame is released and,
+// once the first frames set up everything, the previous frame must not
+// have allocated
+void frameBoundary(unsigned int frame){
+   arenaResetAll();
+   uint64_t allocations = heapAllocationCount();
+   if(checkAllocations && frame > ALLOCATION_WARMUP_FRAMES && allocations != frameAllocations){
+      printf("Frame %u made %llu allocations\n", frame - 1,
+         (unsigned long long)(allocations - frameAllocations));
+      allocatingFrames++;
+   }
+   frameAllocations = allocations;
 }
 
 // ## You are asked to make this code parallel ##
@@ -125,140 +392,1107 @@ void init(){
 // This is done multiple times in a frame because the Euler integration 
 // is not accurate enough to be done only once
 void parallelPhysicsEngine(){
+   frameBoundary(frameNumber);
+   integrateSatelites(satelites, SATELITE_COUNT);
+}
+
+// Decides the color of pixel i. Always inlined, so with a constant count
+// the satelite loops have a fixed trip count. Without testHits the
+// satelite discs are left to stampSatelites() and the first loop has no
+// early exit; pixels off the discs come out bit-identical either way.
+// With a nearest map (see buildVoronoiMap()) the closest satelite is
+// looked up instead of searched.
+static inline __attribute__((always_inline))
+void shadePixel(const satelite* satelites, int i, color* out, const int count,
+                const int testHits, const int* nearest){
+   // Row wise ordering
+   floatvector pixel = {.x = i % WINDOW_WIDTH, .y = i / WINDOW_WIDTH};
+
+   // This color is used for coloring the pixel
+   color renderColor = {.red = 0.f, .green = 0.f, .blue = 0.f};
+
+   // Find closest satelite
+   float shortestDistance = INFINITY;
+
+   float weights = 0.f;
+   int hitsSatellite = 0;
+
+   // First Graphics satelite loop: Find the closest satellite.
+   for(int j = 0; j < count; ++j){
+      floatvector difference = {.x = pixel.x - satelites[j].position.x,
+                                .y = pixel.y - satelites[j].position.y};
+      float distance = sqrt(difference.x * difference.x + 
+                            difference.y * difference.y);
+
+      if(testHits && distance < SATELITE_RADIUS) {
+         renderColor.red = 1.0f;
+         renderColor.green = 1.0f;
+         renderColor.blue = 1.0f;
+         hitsSatellite = 1;
+         break;
+      } else {
+         float weight = 1.0f / (distance*distance*distance*distance);
+         weights += weight;
+         if(!nearest && distance < shortestDistance){
+            shortestDistance = distance;
+            renderColor = satelites[j].identifier;
+         }
+      }
+   }
+   if(nearest && !hitsSatellite){
+      renderColor = satelites[nearest[i]].identifier;
+   }
 
+   // Second graphics loop: Calculate the color based on distance to every satelite.
+   if (!hitsSatellite) {
+      for(int j = 0; j < count; ++j){
+         floatvector difference = {.x = pixel.x - satelites[j].position.x,
+                                   .y = pixel.y - satelites[j].position.y};
+         float dist2 = (difference.x * difference.x +
+                        difference.y * difference.y);
+         float weight = 1.0f/(dist2* dist2);
 
+         renderColor.red += (satelites[j].identifier.red *
+                             weight /weights) * 3.0f;
 
-   // double precision required for accumulation inside this routine,
-   // but float storage is ok outside these loops.
-   doublevector tmpPosition[SATELITE_COUNT];
-   doublevector tmpVelocity[SATELITE_COUNT];
+         renderColor.green += (satelites[j].identifier.green *
+                               weight / weights) * 3.0f;
 
-   for (int i = 0; i < SATELITE_COUNT; ++i) {
-       tmpPosition[i].x = satelites[i].position.x;
-       tmpPosition[i].y = satelites[i].position.y;
-       tmpVelocity[i].x = satelites[i].velocity.x;
-       tmpVelocity[i].y = satelites[i].velocity.y;
+         renderColor.blue += (satelites[j].identifier.blue *
+                              weight / weights) * 3.0f;
+      }
    }
+   *out = renderColor;
+}
 
-   // Physics iteration loop
-   for(int physicsUpdateIndex = 0; 
-       physicsUpdateIndex < PHYSICSUPDATESPERFRAME;
-      ++physicsUpdateIndex){
+// Reduced precision variant of shadePixel(), one pass over the satelites:
+//   - the hit test and the closest satelite compare squared distances, so
+//     no square root is needed at all (the hit test confirms the rare
+//     candidates with sqrtf, so it flips exactly where shadePixel's does)
+//   - every weight is 1 / dist2^2 like in the second loop of shadePixel,
+//     and the weighted colors are summed in the same pass
+//   - weights is inverted once per pixel instead of dividing three times
+//     per satelite.
+// With half set the weighted sum is normalized first and accumulated in
+// _Float16, on CPUs with native fp16 arithmetic (software fp16 is many
+// times slower than float).
+#if defined(__FLT16_MAX__) && (defined(__AVX512FP16__) || defined(__ARM_FEATURE_FP16_VECTOR_ARITHMETIC))
+#define HALF_ARITHMETIC 1
+#endif
+static inline __attribute__((always_inline))
+void shadePixelFast(const satelite* satelites, int i, color* out, const int count,
+                    const int half, const int testHits, const int* nearest){
+   const float hitRadius2 = SATELITE_RADIUS * SATELITE_RADIUS * 1.0001f;
+   floatvector pixel = {.x = i % WINDOW_WIDTH, .y = i / WINDOW_WIDTH};
+   float shortestDistance2 = INFINITY;
+   int closest = 0;
+   int nearHit = 0;
+   float weights = 0.f;
+   float red = 0.f, green = 0.f, blue = 0.f;
+
+   // No early exit, so this loop has no data dependent branches
+   for(int j = 0; j < count; ++j){
+      float dx = pixel.x - satelites[j].position.x;
+      float dy = pixel.y - satelites[j].position.y;
+      float dist2 = dx * dx + dy * dy;
+      nearHit |= dist2 < hitRadius2;
+      if(!nearest){
+         closest = dist2 < shortestDistance2 ? j : closest;
+         shortestDistance2 = fminf(dist2, shortestDistance2);
+      }
+      float weight = 1.0f / (dist2 * dist2);
+      weights += weight;
+      red += satelites[j].identifier.red * weight;
+      green += satelites[j].identifier.green * weight;
+      blue += satelites[j].identifier.blue * weight;
+   }
+   if(nearest){
+      closest = nearest[i];
+   }
+   if(testHits && nearHit){
+      for(int j = 0; j < count; ++j){
+         float dx = pixel.x - satelites[j].position.x;
+         float dy = pixel.y - satelites[j].position.y;
+         if(sqrtf(dx * dx + dy * dy) < SATELITE_RADIUS){
+            *out = (color){.red = 1.0f, .green = 1.0f, .blue = 1.0f};
+            return;
+         }
+      }
+   }
 
-       // Physics satelite loop
-      for(int i = 0; i < SATELITE_COUNT; ++i){
+   float scale = 3.0f / weights;
+#ifdef HALF_ARITHMETIC
+   if(half){
+      // Normalized terms are below 0.5, well inside the fp16 range
+      _Float16 halfRed = 0, halfGreen = 0, halfBlue = 0;
+      for(int j = 0; j < count; ++j){
+         float dx = pixel.x - satelites[j].position.x;
+         float dy = pixel.y - satelites[j].position.y;
+         float dist2 = dx * dx + dy * dy;
+         float normalized = scale / (dist2 * dist2);
+         halfRed += (_Float16)(satelites[j].identifier.red * normalized);
+         halfGreen += (_Float16)(satelites[j].identifier.green * normalized);
+         halfBlue += (_Float16)(satelites[j].identifier.blue * normalized);
+      }
+      red = halfRed;
+      green = halfGreen;
+      blue = halfBlue;
+      scale = 1.0f;
+   }
+#else
+   (void)half;
+#endif
+   out->red = satelites[closest].identifier.red + red * scale;
+   out->green = satelites[closest].identifier.green + green * scale;
+   out->blue = satelites[closest].identifier.blue + blue * scale;
+}
 
-         // Distance to the blackhole (bit ugly code because C-struct cannot have member functions)
-         doublevector positionToBlackHole = {.x = tmpPosition[i].x -
-            HORIZONTAL_CENTER, .y = tmpPosition[i].y - VERTICAL_CENTER};
-         double distToBlackHoleSquared =
-            positionToBlackHole.x * positionToBlackHole.x +
-            positionToBlackHole.y * positionToBlackHole.y;
-         double distToBlackHole = sqrt(distToBlackHoleSquared);
+// Jump flooding (Rong & Tan 2006) builds the map of the closest satelite
+// of every pixel in log2(size) passes over the frame, whatever the number
+// of satelites. Every satelite seeds the pixel it is on, then pass k lets
+// each pixel take the closest of the satelites seen by the pixels at
+// +-step in x and y, step halving from WINDOW_WIDTH / 2 to 1. A second
+// round of steps 16 ... 1 fixes nearly all pixels plain jump flooding gets
+// wrong (thin slivers of a cell cut off from its seed). Distances and ties
+// are decided like in shadePixel(), so with a correct map the renderers
+// give the same colors as without it.
+//
+// Jump flooding alone is not exact: with 1024 satelites about one pixel
+// per frame still gets the color of a neighboring cell. voronoiRepair()
+// therefore searches exactly every pixel whose 8 neighbors do not all
+// agree with it, the pixels around every satelite and the window border
+// (where the cells of satelites outside the window enter), and then the
+// neighbors of every pixel that changed, until nothing changes. A wrong
+// pixel inside a region of agreeing pixels is reached that way from the
+// exact pixels of its own cell, so the map is exact for every cell that
+// covers the pixels around its satelite or touches the border.
+int voronoiJumpFlooding = 0;     // set by --voronoi=jfa
+// Map of the scene being rendered, scratch of the frame arena
+const int* voronoiMap = NULL;
 
-         // Gravity force
-         doublevector normalizedDirection = {
-            .x = positionToBlackHole.x / distToBlackHole,
-            .y = positionToBlackHole.y / distToBlackHole};
-         double accumulation = GRAVITY / distToBlackHoleSquared;
+typedef struct{
+   const satelite* satelites;
+   const int* source;
+   int* target;
+   int step;
+} voronoiPass;
+
+// Rows [begin, end) of one pass. Neighbors past the border are clamped to
+// it, which only adds candidates. Most neighbors name the same satelite,
+// so repeats of the current best are skipped.
+static void voronoiRows(void* context, int begin, int end){
+   const voronoiPass* pass = (const voronoiPass*)context;
+   const satelite* satelites = pass->satelites;
+   const int step = pass->step;
+   for(int y = begin; y < end; ++y){
+      int rows[3] = {y - step < 0 ? 0 : y - step, y,
+                     y + step >= WINDOW_HEIGHT ? WINDOW_HEIGHT - 1 : y + step};
+      for(int x = 0; x < WINDOW_WIDTH; ++x){
+         int columns[3] = {x - step < 0 ? 0 : x - step, x,
+                           x + step >= WINDOW_WIDTH ? WINDOW_WIDTH - 1 : x + step};
+         floatvector pixel = {.x = x, .y = y};
+         int best = -1;
+         float shortestDistance = INFINITY;
+         for(int r = 0; r < 3; ++r){
+            for(int c = 0; c < 3; ++c){
+               int j = pass->source[rows[r] * WINDOW_WIDTH + columns[c]];
+               if(j < 0 || j == best){
+                  continue;
+               }
+               floatvector difference = {.x = pixel.x - satelites[j].position.x,
+                                         .y = pixel.y - satelites[j].position.y};
+               float distance = sqrt(difference.x * difference.x +
+                                     difference.y * difference.y);
+               if(distance < shortestDistance || (distance == shortestDistance && j < best)){
+                  shortestDistance = distance;
+                  best = j;
+               }
+            }
+         }
+         pass->target[y * WINDOW_WIDTH + x] = best;
+      }
+   }
+}
 
-         // Delta time is used to make velocity same despite different FPS
-         // Update velocity based on force
-         tmpVelocity[i].x -= accumulation * normalizedDirection.x *
-            DELTATIME / PHYSICSUPDATESPERFRAME;
-         tmpVelocity[i].y -= accumulation * normalizedDirection.y *
-            DELTATIME / PHYSICSUPDATESPERFRAME;
+// Puts every satelite on its pixel, or on a free pixel next to it when
+// another satelite got there first. Satelites outside the window seed the
+// closest border pixel, their cells can still reach into the window.
+static void voronoiSeed(const satelite* satelites, int* map){
+   memset(map, 0xff, sizeof(int) * SIZE);
+   for(int j = 0; j < SATELITE_COUNT; ++j){
+      int x = (int)fminf(fmaxf(rintf(satelites[j].position.x), 0.f), WINDOW_WIDTH - 1);
+      int y = (int)fminf(fmaxf(rintf(satelites[j].position.y), 0.f), WINDOW_HEIGHT - 1);
+      for(int ring = 0, placed = 0; ring <= 3 && !placed; ++ring){
+         for(int dy = -ring; dy <= ring && !placed; ++dy){
+            for(int dx = -ring; dx <= ring && !placed; ++dx){
+               int nx = x + dx, ny = y + dy;
+               if(nx >= 0 && nx < WINDOW_WIDTH && ny >= 0 && ny < WINDOW_HEIGHT &&
+                  map[ny * WINDOW_WIDTH + nx] < 0){
+                  map[ny * WINDOW_WIDTH + nx] = j;
+                  placed = 1;
+               }
+            }
+         }
+      }
+   }
+}
 
-         // Update position based on velocity
-         tmpPosition[i].x +=
-            tmpVelocity[i].x * DELTATIME / PHYSICSUPDATESPERFRAME;
-         tmpPosition[i].y +=
-            tmpVelocity[i].y * DELTATIME / PHYSICSUPDATESPERFRAME;
+// Runs body over all rows, on the work-stealing scheduler or OpenMP
+static void voronoiForRows(void (*body)(void*, int, int), void* context){
+   if(scheduler){
+      schedParallelFor(scheduler, WINDOW_HEIGHT, 8, body, context, -1);
+   } else {
+#pragma omp parallel for schedule(static)
+      for(int y = 0; y < WINDOW_HEIGHT; ++y){
+         body(context, y, y + 1);
       }
    }
+}
 
-   // double precision required for accumulation inside this routine,
-   // but float storage is ok outside these loops.
-   // copy back the float storage.
-   for (int i = 0; i < SATELITE_COUNT; ++i) {
-       satelites[i].position.x = tmpPosition[i].x;
-       satelites[i].position.y = tmpPosition[i].y;
-       satelites[i].velocity.x = tmpVelocity[i].x;
-       satelites[i].velocity.y = tmpVelocity[i].y;
+// Closest satelite of pixel (x, y) by searching all of them, with the
+// distances and ties of shadePixel()
+static inline int voronoiExact(const satelite* satelites, int x, int y){
+   floatvector pixel = {.x = x, .y = y};
+   float shortestDistance = INFINITY;
+   int best = 0;
+   for(int j = 0; j < SATELITE_COUNT; ++j){
+      floatvector difference = {.x = pixel.x - satelites[j].position.x,
+                                .y = pixel.y - satelites[j].position.y};
+      float distance = sqrt(difference.x * difference.x +
+                            difference.y * difference.y);
+      if(distance < shortestDistance){
+         shortestDistance = distance;
+         best = j;
+      }
    }
+   return best;
+}
 
+typedef struct{
+   const satelite* satelites;
+   int* map;
+   const unsigned char* check;      // pixels to search exactly
+   unsigned char* next;             // their neighbors when they changed
+   int changed;
+} voronoiRepairPass;
+
+// Marks the pixels without a satelite or with a neighbor of another one,
+// and the border rows and columns
+static void voronoiMarkRows(void* context, int begin, int end){
+   const voronoiRepairPass* pass = (const voronoiRepairPass*)context;
+   const int* map = pass->map;
+   unsigned char* check = pass->next;
+   for(int y = begin; y < end; ++y){
+      for(int x = 0; x < WINDOW_WIDTH; ++x){
+         int j = map[y * WINDOW_WIDTH + x];
+         int mark = j < 0 || x == 0 || y == 0 || x == WINDOW_WIDTH - 1 || y == WINDOW_HEIGHT - 1;
+         for(int ny = y - 1; ny <= y + 1 && !mark; ++ny){
+            for(int nx = x - 1; nx <= x + 1 && !mark; ++nx){
+               mark = map[ny * WINDOW_WIDTH + nx] != j;
+            }
+         }
+         check[y * WINDOW_WIDTH + x] = (unsigned char)mark;
+      }
+   }
+}
+
+// Searches the marked pixels of rows [begin, end) exactly and marks the
+// neighbors of the ones that changed for the next round
+static void voronoiRepairRows(void* context, int begin, int end){
+   voronoiRepairPass* pass = (voronoiRepairPass*)context;
+   for(int y = begin; y < end; ++y){
+      for(int x = 0; x < WINDOW_WIDTH; ++x){
+         int i = y * WINDOW_WIDTH + x;
+         if(!pass->check[i]){
+            continue;
+         }
+         int j = voronoiExact(pass->satelites, x, y);
+         if(j == pass->map[i]){
+            continue;
+         }
+         pass->map[i] = j;
+         __atomic_store_n(&pass->changed, 1, __ATOMIC_RELAXED);
+         for(int ny = y - 1; ny <= y + 1; ++ny){
+            for(int nx = x - 1; nx <= x + 1; ++nx){
+               if(nx >= 0 && nx < WINDOW_WIDTH && ny >= 0 && ny < WINDOW_HEIGHT){
+                  __atomic_store_n(&pass->next[ny * WINDOW_WIDTH + nx], 1, __ATOMIC_RELAXED);
+               }
+            }
+         }
+      }
+   }
+}
+
+// Makes the jump flooding map exact, see above. check and next are frame
+// sized scratch.
+static void voronoiRepair(const satelite* satelites, int* map,
+                          unsigned char* check, unsigned char* next){
+   voronoiRepairPass pass = {.satelites = satelites, .map = map, .next = check};
+   voronoiForRows(voronoiMarkRows, &pass);
+   for(int j = 0; j < SATELITE_COUNT; ++j){
+      int x = (int)fminf(fmaxf(rintf(satelites[j].position.x), 0.f), WINDOW_WIDTH - 1);
+      int y = (int)fminf(fmaxf(rintf(satelites[j].position.y), 0.f), WINDOW_HEIGHT - 1);
+      for(int ny = y - 1; ny <= y + 1; ++ny){
+         for(int nx = x - 1; nx <= x + 1; ++nx){
+            if(nx >= 0 && nx < WINDOW_WIDTH && ny >= 0 && ny < WINDOW_HEIGHT){
+               check[ny * WINDOW_WIDTH + nx] = 1;
+            }
+         }
+      }
+   }
+   // Every pixel changes at most once, to its exact satelite
+   do{
+      memset(next, 0, SIZE);
+      pass.check = check;
+      pass.next = next;
+      pass.changed = 0;
+      voronoiForRows(voronoiRepairRows, &pass);
+      unsigned char* swap = check;
+      check = next;
+      next = swap;
+   } while(pass.changed);
+}
+
+// Builds the closest satelite map of a scene and makes it voronoiMap. The
+// maps are scratch of the calling thread's frame arena.
+static void buildVoronoiMap(const satelite* satelites){
+   int* buffers[2] = {(int*)arenaAllocate(sizeof(int) * SIZE),
+                      (int*)arenaAllocate(sizeof(int) * SIZE)};
+   unsigned char* checks[2] = {(unsigned char*)arenaAllocate(SIZE),
+                               (unsigned char*)arenaAllocate(SIZE)};
+   if(!buffers[0] || !buffers[1] || !checks[0] || !checks[1]){
+      printf("Could not allocate the closest satelite maps\n");
+      exit(EXIT_FAILURE);
+   }
+   int steps[32];
+   int passes = 0;
+   for(int step = WINDOW_WIDTH / 2; step >= 1; step /= 2){
+      steps[passes++] = step;
+   }
+   for(int step = 16; step >= 1; step /= 2){
+      steps[passes++] = step;
+   }
+
+   voronoiSeed(satelites, buffers[0]);
+   for(int p = 0; p < passes; ++p){
+      voronoiPass pass = {.satelites = satelites, .source = buffers[p % 2],
+                          .target = buffers[(p + 1) % 2], .step = steps[p]};
+      voronoiForRows(voronoiRows, &pass);
+   }
+   voronoiRepair(satelites, buffers[passes % 2], checks[0], checks[1]);
+   voronoiMap = buffers[passes % 2];
+}
+
+// Colors pixels [begin, end) of one scene into out[0] ... out[end - begin - 1]
+typedef void (*rangeRenderer)(const satelite* satelites, color* out, int begin, int end);
+
+// The fast renderers are also compiled for wider vector units, and the
+// loader picks the widest version this CPU supports. The exact ones stay
+// on the baseline, where they round like the reference renderer.
+#if defined(__x86_64__) && defined(__linux__) && defined(__GNUC__)
+#define SIMD_CLONES __attribute__((target_clones("avx512f", "avx2", "default")))
+#else
+#define SIMD_CLONES
+#endif
+
+// Renderers for one satelite count, a constant for the specialized ones.
+// Every kind comes in four variants: with or without hit tests (Field
+// variants leave them to stampSatelites()), and searching the closest
+// satelite or reading it from voronoiMap.
+#define DEFINE_RENDERER(attributes, function, shade) \
+   attributes static void function(const satelite* satelites, color* out, \
+                                   int begin, int end){ \
+      for(int i = begin; i < end; ++i){ \
+         shade; \
+      } \
+   }
+#define DEFINE_RENDERER_VARIANTS(attributes, function, shade, ...) \
+   DEFINE_RENDERER(attributes, function, \
+      shade(satelites, i, &out[i - begin], __VA_ARGS__, 1, NULL)) \
+   DEFINE_RENDERER(attributes, function##Field, \
+      shade(satelites, i, &out[i - begin], __VA_ARGS__, 0, NULL)) \
+   DEFINE_RENDERER(attributes, function##Voronoi, \
+      shade(satelites, i, &out[i - begin], __VA_ARGS__, 1, voronoiMap)) \
+   DEFINE_RENDERER(attributes, function##VoronoiField, \
+      shade(satelites, i, &out[i - begin], __VA_ARGS__, 0, voronoiMap))
+#define DEFINE_RENDERERS(name, count) \
+   DEFINE_RENDERER_VARIANTS(, renderExact##name, shadePixel, count) \
+   DEFINE_RENDERER_VARIANTS(SIMD_CLONES, renderFast##name, shadePixelFast, count, 0) \
+   DEFINE_RENDERER_VARIANTS(SIMD_CLONES, renderHalf##name, shadePixelFast, count, 1)
+
+DEFINE_RENDERERS(16, 16)
+DEFINE_RENDERERS(64, 64)
+DEFINE_RENDERERS(256, 256)
+DEFINE_RENDERERS(1024, 1024)
+DEFINE_RENDERERS(Generic, sateliteCount)
+
+// Indexed [voronoi][testHits]
+typedef struct{
+   int count;
+   rangeRenderer exact[2][2];
+   rangeRenderer fast[2][2];
+   rangeRenderer half[2][2];
+} rendererSet;
+
+#define RENDERER_VARIANTS(function) \
+   {{function##Field, function}, {function##VoronoiField, function##Voronoi}}
+#define RENDERER_SET(name, count) {count, RENDERER_VARIANTS(renderExact##name), \
+   RENDERER_VARIANTS(renderFast##name), RENDERER_VARIANTS(renderHalf##name)}
+
+static const rendererSet renderers[] = {
+   RENDERER_SET(16, 16),
+   RENDERER_SET(64, 64),
+   RENDERER_SET(256, 256),
+   RENDERER_SET(1024, 1024),
+   RENDERER_SET(Generic, 0)
+};
+
+// Set by --stamp
+int stampDiscs = 0;
+
+// Draws the white satelite discs over a frame rendered without hit tests.
+// Same distance test as the renderers, but only over the bounding box of
+// every satelite, about 50 pixels each.
+static void stampSatelites(const satelite* satelites, color* pixels){
+   const color white = {.red = 1.0f, .green = 1.0f, .blue = 1.0f};
+   for(int j = 0; j < SATELITE_COUNT; ++j){
+      floatvector position = satelites[j].position;
+      if(!(position.x > -SATELITE_RADIUS && position.x < WINDOW_WIDTH + SATELITE_RADIUS &&
+           position.y > -SATELITE_RADIUS && position.y < WINDOW_HEIGHT + SATELITE_RADIUS)){
+         continue;
+      }
+      int x0 = (int)fmaxf(floorf(position.x - SATELITE_RADIUS), 0.f);
+      int x1 = (int)fminf(ceilf(position.x + SATELITE_RADIUS), WINDOW_WIDTH - 1);
+      int y0 = (int)fmaxf(floorf(position.y - SATELITE_RADIUS), 0.f);
+      int y1 = (int)fminf(ceilf(position.y + SATELITE_RADIUS), WINDOW_HEIGHT - 1);
+      for(int y = y0; y <= y1; ++y){
+         for(int x = x0; x <= x1; ++x){
+            floatvector difference = {.x = (float)x - position.x,
+                                      .y = (float)y - position.y};
+            float distance = sqrt(difference.x * difference.x +
+                                  difference.y * difference.y);
+            if(distance < SATELITE_RADIUS){
+               pixels[y * WINDOW_WIDTH + x] = white;
+            }
+         }
+      }
+   }
+}
+
+// Selected by pickRenderer()
+rangeRenderer renderer = renderExact64;
+const char* rendererMode = "exact";
+
+// Adaptive rendering (--adaptive). Every tile is a quadtree of square
+// cells. A cell is filled by bilinear interpolation of its four rendered
+// corners when
+//   - the corners have the same closest satelite, so the whole cell has
+//     (Voronoi cells are convex) and the closest color term is constant
+//   - no satelite disc reaches into the cell
+//   - the interpolation error of the weighted color sum is provably at
+//     most adaptiveBound,
+// otherwise it is split in four, and cells of ADAPTIVE_MIN_CELL pixels
+// are rendered.
+//
+// The weighted sum is g = 3 sum c_j p_j with p_j = w_j / sum w_k and
+// w_j = r_j^-4. With u_j = log w_j, along x or y
+//    g'' = 3 (Cov_p(c, u'') + E_p[(c - E_p c) (u' - E_p u')^2])
+// and |u'| <= 4 / r, |u''| <= 4 / r^2, so |g''| <= 60 spread / dmin^2,
+// spread being the largest difference of one color channel between two
+// satelites and dmin the distance from the cell to the closest satelite.
+// Bilinear interpolation over an h x h cell is then off by at most
+// h^2 / 8 (|g_xx| + |g_yy|) <= 15 h^2 spread / dmin^2.
+#define ADAPTIVE_MIN_CELL 2
+#define ADAPTIVE_DEFAULT_BOUND (ALLOWED_FP_ERROR / 2)
+double adaptiveBound = 0.0;      // 0 renders every pixel
+// Pixels rendered and pixels produced, for the statistics at exit
+uint64_t adaptiveEvaluated = 0;
+uint64_t adaptivePixels = 0;
+
+typedef struct{
+   const satelite* satelites;
+   color* pixels;
+   float colorSpread;
+   int x0, y0;                   // top left pixel of the tile
+   int evaluated;
+   // Cell corners, including the first row and column of the next tiles
+   color samples[TILE_SIZE + 1][TILE_SIZE + 1];
+   int closest[TILE_SIZE + 1][TILE_SIZE + 1];    // -1 until rendered
+} adaptiveTile;
+
+// Largest difference of one color channel between two satelites
+static float colorSpread(const satelite* satelites){
+   color low = satelites[0].identifier, high = satelites[0].identifier;
+   for(int j = 1; j < SATELITE_COUNT; ++j){
+      color c = satelites[j].identifier;
+      low = (color){fminf(low.red, c.red), fminf(low.green, c.green), fminf(low.blue, c.blue)};
+      high = (color){fmaxf(high.red, c.red), fmaxf(high.green, c.green), fmaxf(high.blue, c.blue)};
+   }
+   return fmaxf(high.red - low.red, fmaxf(high.green - low.green, high.blue - low.blue));
+}
+
+// Renders the corner (x0 + gx, y0 + gy) once. Returns its closest satelite.
+static int adaptiveSample(adaptiveTile* t, int gx, int gy){
+   if(t->closest[gy][gx] < 0){
+      float x = t->x0 + gx, y = t->y0 + gy;
+      int i = (t->y0 + gy) * WINDOW_WIDTH + t->x0 + gx;
+      renderer(t->satelites, &t->samples[gy][gx], i, i + 1);
+      float shortestDistance2 = INFINITY;
+      int closest = 0;
+      for(int j = 0; j < SATELITE_COUNT; ++j){
+         float dx = x - t->satelites[j].position.x;
+         float dy = y - t->satelites[j].position.y;
+         float dist2 = dx * dx + dy * dy;
+         closest = dist2 < shortestDistance2 ? j : closest;
+         shortestDistance2 = fminf(dist2, shortestDistance2);
+      }
+      t->closest[gy][gx] = closest;
+      t->evaluated++;
+   }
+   return t->closest[gy][gx];
+}
+
+// Whether the cell is clear of discs and its error bound holds
+static int adaptiveSmooth(const adaptiveTile* t, int gx, int gy, int h){
+   float x0 = t->x0 + gx, x1 = x0 + h;
+   float y0 = t->y0 + gy, y1 = y0 + h;
+   float nearest2 = INFINITY;
+   for(int j = 0; j < SATELITE_COUNT; ++j){
+      floatvector p = t->satelites[j].position;
+      float dx = fmaxf(fmaxf(x0 - p.x, p.x - x1), 0.f);
+      float dy = fmaxf(fmaxf(y0 - p.y, p.y - y1), 0.f);
+      nearest2 = fminf(nearest2, dx * dx + dy * dy);
+   }
+   // One pixel of margin keeps the discs' rounding out of the cell
+   return nearest2 > (SATELITE_RADIUS + 1.f) * (SATELITE_RADIUS + 1.f) &&
+      15.0 * h * h * t->colorSpread <= adaptiveBound * nearest2;
+}
+
+static inline color lerpColor(color a, color b, float f){
+   return (color){a.red + (b.red - a.red) * f, a.green + (b.green - a.green) * f,
+                  a.blue + (b.blue - a.blue) * f};
+}
+
+// Fills the pixels of the cell, corners excluded except the top left one
+static void adaptiveFill(adaptiveTile* t, int gx, int gy, int h){
+   color c00 = t->samples[gy][gx], c10 = t->samples[gy][gx + h];
+   color c01 = t->samples[gy + h][gx], c11 = t->samples[gy + h][gx + h];
+   for(int y = 0; y < h; ++y){
+      color left = lerpColor(c00, c01, (float)y / h);
+      color right = lerpColor(c10, c11, (float)y / h);
+      color* row = &t->pixels[(t->y0 + gy + y) * WINDOW_WIDTH + t->x0 + gx];
+      for(int x = 0; x < h; ++x){
+         row[x] = lerpColor(left, right, (float)x / h);
+      }
+   }
+}
+
+static void adaptiveCell(adaptiveTile* t, int gx, int gy, int h){
+   // Corners on the far window edges do not exist, such cells are split
+   if(t->x0 + gx + h < WINDOW_WIDTH && t->y0 + gy + h < WINDOW_HEIGHT){
+      int k = adaptiveSample(t, gx, gy);
+      if(k == adaptiveSample(t, gx + h, gy) && k == adaptiveSample(t, gx, gy + h) &&
+         k == adaptiveSample(t, gx + h, gy + h) && adaptiveSmooth(t, gx, gy, h)){
+         adaptiveFill(t, gx, gy, h);
+         return;
+      }
+   }
+   if(h > ADAPTIVE_MIN_CELL){
+      h /= 2;
+      adaptiveCell(t, gx, gy, h);
+      adaptiveCell(t, gx + h, gy, h);
+      adaptiveCell(t, gx, gy + h, h);
+      adaptiveCell(t, gx + h, gy + h, h);
+      return;
+   }
+   for(int y = t->y0 + gy; y < t->y0 + gy + h; ++y){
+      int i = y * WINDOW_WIDTH + t->x0 + gx;
+      renderer(t->satelites, &t->pixels[i], i, i + h);
+   }
+   t->evaluated += h * h;
+}
+
+// Scheduler task: square tiles of one scene
+typedef struct{
+   const satelite* satelites;
+   color* pixels;
+   float colorSpread;            // for adaptive rendering
+} renderJob;
+
+static void renderTile(const renderJob* job, int tile){
+   int x0 = tile % TILES_PER_ROW * TILE_SIZE;
+   int y0 = tile / TILES_PER_ROW * TILE_SIZE;
+   if(adaptiveBound > 0){
+      adaptiveTile t = {.satelites = job->satelites, .pixels = job->pixels,
+                        .colorSpread = job->colorSpread, .x0 = x0, .y0 = y0};
+      memset(t.closest, -1, sizeof(t.closest));
+      adaptiveCell(&t, 0, 0, TILE_SIZE);
+      __atomic_fetch_add(&adaptiveEvaluated, t.evaluated, __ATOMIC_RELAXED);
+      return;
+   }
+   for(int y = y0; y < y0 + TILE_SIZE; ++y){
+      int i = y * WINDOW_WIDTH + x0;
+      renderer(job->satelites, &job->pixels[i], i, i + TILE_SIZE);
+   }
+}
+
+static void renderTiles(void* context, int begin, int end){
+   for(int tile = begin; tile < end; ++tile){
+      renderTile((const renderJob*)context, tile);
+   }
+}
+
+// Decides the color for each pixel of one scene
+static void renderScene(const satelite* satelites, color* pixels){
+   renderJob job = {.satelites = satelites, .pixels = pixels};
+   // Scratch of this scene is given back when it is done
+   size_t scratch = arenaMark();
+   if(voronoiJumpFlooding){
+      buildVoronoiMap(satelites);
+   }
+   if(adaptiveBound > 0){
+      job.colorSpread = colorSpread(satelites);
+      adaptivePixels += SIZE;
+   }
+   if(scheduler){
+      // Tiles near satelites cost the most, stealing spreads them
+      schedParallelFor(scheduler, TILE_COUNT, 1, renderTiles, &job,
+         TRACE_COLORING_THREAD);
+   } else if(adaptiveBound > 0){
+      // Tiles differ a lot in cost, so they are handed out one by one
+#pragma omp parallel
+      {
+         TRACE_SCOPE(TRACE_COLORING_THREAD);
+#pragma omp for schedule(dynamic) nowait
+         for(int tile = 0; tile < TILE_COUNT; ++tile){
+            renderTile(&job, tile);
+         }
+      }
+   } else {
+       // Graphics pixel loop
+#pragma omp parallel
+       {
+          // Every thread times its own share to show imbalance
+          TRACE_SCOPE(TRACE_COLORING_THREAD);
+#pragma omp for schedule(static) nowait
+          for(int y = 0; y < WINDOW_HEIGHT; ++y) {
+             renderer(satelites, &pixels[y * WINDOW_WIDTH], y * WINDOW_WIDTH,
+                (y + 1) * WINDOW_WIDTH);
+          }
+       }
+   }
+   if(stampDiscs){
+      stampSatelites(satelites, pixels);
+   }
+   voronoiMap = NULL;
+   arenaRewind(scratch);
+}
+
+// Share of the pixels the adaptive renderer evaluated
+void printAdaptiveStatistics(void){
+   if(adaptivePixels > 0){
+      printf("Adaptive rendering evaluated %.1f%% of %llu pixels, error bound %.4f\n",
+         100.0 * adaptiveEvaluated / adaptivePixels, (unsigned long long)adaptivePixels,
+         adaptiveBound);
+   }
 }
 
 // ## You are asked to make this code parallel ##
 // Rendering loop (This is called once a frame after physics engine) 
 // Decides the color for each pixel.
 void parallelGraphicsEngine(){
+   renderScene(satelites, pixels);
+}
 
-    // Graphics pixel loop
-#pragma omp parallel for shared(satelites)
-    for(int i = 0 ;i < SIZE; ++i) {
+// Frame buffers are split by threads the same way as the pixel loop, and
+// every share is placed on the node of the thread that colors it
+color* allocateFrameBuffer(void){
+   color* buffer = (color*)alignedAllocate(sizeof(color) * SIZE, ALLOC_CACHE_LINE);
+   if(buffer){
+#pragma omp parallel
+      numaPlaceShare(buffer, SIZE, sizeof(color), omp_get_thread_num(),
+         omp_get_num_threads());
+   }
+   return buffer;
+}
 
-      // Row wise ordering
-      floatvector pixel = {.x = i % WINDOW_WIDTH, .y = i / WINDOW_WIDTH};
+void freeFrameBuffer(color* buffer){
+   alignedFree(buffer, sizeof(color) * SIZE);
+}
 
-      // This color is used for coloring the pixel
-      color renderColor = {.red = 0.f, .green = 0.f, .blue = 0.f};
+void reportFrameBuffer(const color* buffer, const char* label){
+   if(allocReportAtExit){
+      allocPrintStatistics(stdout);
+      arenaPrintStatistics(stdout);
+   }
+   if(numaReportAtExit && buffer){
+      numaReport(buffer, SIZE, sizeof(color), omp_get_max_threads(), label);
+   }
+}
 
-      // Find closest satelite
-      float shortestDistance = INFINITY;
+// Dispatches to the renderer of the color mode that is specialized for
+// sateliteCount, or the generic one for other counts
+void pickRenderer(const char* colorMode){
+   int set = 0;
+   while(renderers[set].count != 0 && renderers[set].count != sateliteCount){
+      set++;
+   }
+   if(renderers[set].count == 0){
+      printf("No renderer is specialized for %d satelites, using the generic one\n",
+         sateliteCount);
+   }
+   rendererMode = colorMode ? colorMode : "exact";
+   if(!colorMode || strcmp(colorMode, "exact") == 0){
+      renderer = renderers[set].exact[voronoiJumpFlooding][!stampDiscs];
+   } else if(strcmp(colorMode, "fast") == 0){
+      renderer = renderers[set].fast[voronoiJumpFlooding][!stampDiscs];
+   } else if(strcmp(colorMode, "half") == 0){
+#ifndef HALF_ARITHMETIC
+      printf("No native fp16 arithmetic on this target, --color=half runs as fast\n");
+#endif
+      renderer = renderers[set].half[voronoiJumpFlooding][!stampDiscs];
+   } else {
+      printf("Unknown --color=%s, expected exact, fast or half\n", colorMode);
+      exit(EXIT_FAILURE);
+   }
+}
 
-      float weights = 0.f;
-      int hitsSatellite = 0;
+static void pinWorker(int worker, int workerCount){
+   numaPinThread(worker, workerCount);
+}
 
-      // First Graphics satelite loop: Find the closest satellite.
-      for(int j = 0; j < SATELITE_COUNT; ++j){
-         floatvector difference = {.x = pixel.x - satelites[j].position.x,
-                                   .y = pixel.y - satelites[j].position.y};
-         float distance = sqrt(difference.x * difference.x + 
-                               difference.y * difference.y);
+// Reads the batch mode options. The first non-option argument is the seed.
+void parseArguments(int argc, char** argv){
+   sateliteCount = optionLong(argc, argv, "satelites", DEFAULT_SATELITE_COUNT);
+   if(sateliteCount < 1){
+      printf("--satelites must be at least 1\n");
+      exit(EXIT_FAILURE);
+   }
+   ensembleSize = optionLong(argc, argv, "ensemble", 0);
+   batchFrames = optionLong(argc, argv, "frames", 1);
+   if(optionValue(argc, argv, "output")){
+      outputDirectory = optionValue(argc, argv, "output");
+   }
+   recordPath = optionValue(argc, argv, "record");
+   recordQueueDepth = optionLong(argc, argv, "record-queue", 4);
+   recordDropWhenFull = optionFlag(argc, argv, "record-drop");
+   if(optionValue(argc, argv, "validate")){
+      validateMode = optionValue(argc, argv, "validate");
+   }
+   validateEvery = optionLong(argc, argv, "validate-every", 0);
+   validateStrict = optionFlag(argc, argv, "validate-strict");
+   if(allocSetMode(optionValue(argc, argv, "huge-pages"))){
+      exit(EXIT_FAILURE);
+   }
+   if(numaInit(optionValue(argc, argv, "numa"), optionFlag(argc, argv, "pin"))){
+      exit(EXIT_FAILURE);
+   }
+   numaReportAtExit = optionFlag(argc, argv, "numa-report");
+   allocReportAtExit = optionFlag(argc, argv, "alloc-report");
+   checkAllocations = optionFlag(argc, argv, "check-allocations");
+   if(checkAllocations && !heapAllocationsCounted()){
+      printf("Built without -DCOUNT_ALLOCATIONS, only large buffers and arena overflows are counted\n");
+   }
+   if(numaGlobal.pin){
+      // OpenMP keeps its threads, so they stay pinned for every region
+#pragma omp parallel
+      numaPinThread(omp_get_thread_num(), omp_get_num_threads());
+   }
+   stampDiscs = optionFlag(argc, argv, "stamp");
+   const char* voronoi = optionValue(argc, argv, "voronoi");
+   if(voronoi && strcmp(voronoi, "jfa") == 0){
+      voronoiJumpFlooding = 1;
+   } else if(voronoi && strcmp(voronoi, "search") != 0){
+      printf("Unknown --voronoi=%s, expected search or jfa\n", voronoi);
+      exit(EXIT_FAILURE);
+   }
+   if(optionFlag(argc, argv, "adaptive")){
+      const char* bound = optionValue(argc, argv, "adaptive");
+      adaptiveBound = bound ? atof(bound) : ADAPTIVE_DEFAULT_BOUND;
+      // The bound is on top of the error of the color mode
+      if(!(adaptiveBound > 0 && adaptiveBound < ALLOWED_FP_ERROR)){
+         printf("--adaptive bound must be above 0 and below %.3f\n", ALLOWED_FP_ERROR);
+         exit(EXIT_FAILURE);
+      }
+   }
+   pickRenderer(optionValue(argc, argv, "color"));
+   const char* schedule = optionValue(argc, argv, "sched");
+   if(schedule && strcmp(schedule, "steal") == 0){
+      // Workers are pinned like the OpenMP threads of the same number
+      scheduler = schedCreate(omp_get_max_threads(), numaGlobal.pin ? pinWorker : NULL);
+   } else if(schedule && strcmp(schedule, "omp") != 0){
+      printf("Unknown --sched=%s, using omp\n", schedule);
+   }
+   tracePath = optionValue(argc, argv, "trace");
+   if(tracePath || optionFlag(argc, argv, "trace-summary")){
+      traceInit(tracePath != NULL);
+   }
+   if(optionFlag(argc, argv, "perf") || optionValue(argc, argv, "perf-fp")){
+      perfInit(optionValue(argc, argv, "perf-fp"));
+   }
+   if(optionFlag(argc, argv, "roofline")){
+      rooflineInit(optionValue(argc, argv, "roofline"));
+   }
+}
 
-         if(distance < SATELITE_RADIUS) {
-            renderColor.red = 1.0f;
-            renderColor.green = 1.0f;
-            renderColor.blue = 1.0f;
-            hitsSatellite = 1;
-            break;
-         } else {
-            float weight = 1.0f / (distance*distance*distance*distance);
-            weights += weight;
-            if(distance < shortestDistance){
-               shortestDistance = distance;
-               renderColor = satelites[j].identifier;
-            }
-         }
+// FLOPs and bytes of the engines for --roofline, counted from the loops
+// above: a square root or a division is one FLOP, compares and minimums
+// are none. Bytes are what a span must move to or from memory, the
+// satelites of a scene stay in the caches.
+// Physics, per satelite and update: the offset (2), its squared length
+// (3), sqrt, the direction (2), the gravity (1), per axis the velocity
+// (3 + 1) and the position (2 + 1).
+#define PHYSICS_FLOPS 23
+// Colors per pixel and satelite: shadePixel searches (11) then weighs (19),
+// shadePixelFast does both in one pass (14), plus a second pass with half
+#define EXACT_COLOR_FLOPS 30
+#define FAST_COLOR_FLOPS 14
+#define HALF_COLOR_FLOPS 13
+// Per pixel after the satelite loop of shadePixelFast
+#define FAST_PIXEL_FLOPS 7
+// Jump flooding, per pixel and pass: at most 9 candidates of 6 FLOPs, a
+// map read and written
+#define VORONOI_FLOPS (9 * 6)
+#define VORONOI_BYTES (2 * sizeof(int))
+// Stamping, per satelite: its bounding box of distance tests
+#define STAMP_FLOPS (7 * 7 * 6)
+
+void reportRoofline(void){
+   if(!rooflineGlobal.enabled){
+      return;
+   }
+   double satelites = (double)SATELITE_COUNT * (ensembleSize > 0 ? ensembleSize : 1);
+   rooflineKernel physics = {.engine = "physics", .onHost = 1, .doublePrecision = 1,
+      .flops = PHYSICS_FLOPS * (double)PHYSICSUPDATESPERFRAME * satelites,
+      .bytes = 2.0 * sizeof(floatvector) * 2 * satelites};
+   snprintf(physics.variant, sizeof(physics.variant), "%s", scheduler ? "steal" : "omp");
+   snprintf(physics.device, sizeof(physics.device), "host");
+   physics.spans = rooflinePhaseTime(TRACE_PHYSICS, &physics.seconds);
+   physics.countedFlops = physics.spans > 0 ?
+      rooflineCountedFlops(TRACE_PHYSICS_THREAD) / physics.spans : 0.0;
+   rooflineAddKernel(&physics);
+
+   double pixelFlops = EXACT_COLOR_FLOPS * (double)SATELITE_COUNT;
+   if(strcmp(rendererMode, "exact") != 0){
+      pixelFlops = FAST_COLOR_FLOPS * (double)SATELITE_COUNT + FAST_PIXEL_FLOPS;
+#ifdef HALF_ARITHMETIC
+      if(strcmp(rendererMode, "half") == 0){
+         pixelFlops += HALF_COLOR_FLOPS * (double)SATELITE_COUNT;
       }
+#endif
+   }
+   // Adaptive rendering only evaluates part of the pixels
+   double evaluated = adaptivePixels > 0 ? (double)adaptiveEvaluated / adaptivePixels : 1.0;
+   rooflineKernel coloring = {.engine = "coloring", .onHost = 1, .doublePrecision = 0,
+      .flops = pixelFlops * SIZE * evaluated,
+      .bytes = (double)sizeof(color) * SIZE + (double)sizeof(satelite) * SATELITE_COUNT};
+   if(voronoiJumpFlooding){
+      double passes = log2(WINDOW_WIDTH) + 5;
+      coloring.flops += VORONOI_FLOPS * passes * SIZE;
+      coloring.bytes += VORONOI_BYTES * passes * SIZE;
+   }
+   if(stampDiscs){
+      coloring.flops += STAMP_FLOPS * (double)SATELITE_COUNT;
+   }
+   snprintf(coloring.variant, sizeof(coloring.variant), "%s%s%s%s", rendererMode,
+      voronoiJumpFlooding ? "+jfa" : "", stampDiscs ? "+stamp" : "",
+      adaptivePixels > 0 ? "+adaptive" : "");
+   snprintf(coloring.device, sizeof(coloring.device), "host");
+   coloring.spans = rooflinePhaseTime(TRACE_COLORING, &coloring.seconds);
+   coloring.countedFlops = coloring.spans > 0 ?
+      rooflineCountedFlops(TRACE_COLORING_THREAD) / coloring.spans : 0.0;
+   rooflineAddKernel(&coloring);
+
+   rooflineReport(stdout);
+}
 
-      // Second graphics loop: Calculate the color based on distance to every satelite.
-      if (!hitsSatellite) {
-         for(int j = 0; j < SATELITE_COUNT; ++j){
-            floatvector difference = {.x = pixel.x - satelites[j].position.x,
-                                      .y = pixel.y - satelites[j].position.y};
-            float dist2 = (difference.x * difference.x +
-                           difference.y * difference.y);
-            float weight = 1.0f/(dist2* dist2);
+// Stops the scheduler workers
+void stopScheduler(void){
+   if(scheduler){
+      schedPrintStatistics(scheduler, stdout);
+      schedDestroy(scheduler);
+      scheduler = NULL;
+   }
+}
 
-            renderColor.red += (satelites[j].identifier.red *
-                                weight /weights) * 3.0f;
+// Prints the phase histograms and writes the trace file, once
+void finishTrace(void){
+   if(!traceGlobal.enabled){
+      return;
+   }
+   traceSummary(stdout);
+   perfSummary(stdout);
+   if(tracePath){
+      if(traceWrite(tracePath)){
+         printf("Could not write trace %s\n", tracePath);
+      } else {
+         printf("Trace written to %s\n", tracePath);
+      }
+   }
+   traceGlobal.enabled = 0;
+}
 
-            renderColor.green += (satelites[j].identifier.green *
-                                  weight / weights) * 3.0f;
+// Runs ensembleSize independent scenes with seeds seed, seed + 1, ...
+// without opening a window. Physics of all scenes is integrated as one
+// batch so that even small scenes keep every core busy, then each scene
+// is rendered to its own frame buffer. The last frame of every scene is
+// written as a PPM image and the final satelite state as CSV.
+int runEnsemble(void){
+   unsigned int firstSeed = seed != 0 ? seed : 1;
+   int totalSatelites = ensembleSize * SATELITE_COUNT;
+
+   scene* scenes = (scene*)malloc(sizeof(scene) * ensembleSize);
+   satelite* allSatelites = (satelite*)alignedAllocate(sizeof(satelite) * totalSatelites,
+      ALLOC_CACHE_LINE);
+   if(!scenes || !allSatelites){
+      printf("Could not allocate an ensemble of %u scenes\n", ensembleSize);
+      return EXIT_FAILURE;
+   }
 
-            renderColor.blue += (satelites[j].identifier.blue *
-                                 weight / weights) * 3.0f;
+   for(unsigned int k = 0; k < ensembleSize; ++k){
+      scenes[k].seed = firstSeed + k;
+      scenes[k].satelites = allSatelites + k * SATELITE_COUNT;
+      scenes[k].pixels = allocateFrameBuffer();
+      if(!scenes[k].pixels){
+         printf("Could not allocate frame buffer of scene %u\n", k);
+         return EXIT_FAILURE;
+      }
+      srand(scenes[k].seed);
+      initSatelites(scenes[k].satelites);
+   }
+
+   // Every scene records to its own stream, each with its own queue
+   frameSink** sinks = NULL;
+   if(recordPath){
+      char path[4096];
+      sinks = (frameSink**)malloc(sizeof(frameSink*) * ensembleSize);
+      for(unsigned int k = 0; k < ensembleSize; ++k){
+         frameSinkStreamPath(recordPath, "seed", scenes[k].seed, path, sizeof(path));
+         sinks[k] = openRecorder(path, batchFrames);
+      }
+   }
+
+   // All scenes share one reference frame for validation
+   color* reference = allocateFrameBuffer();
+
+   uint64_t startTime = nowNanoseconds();
+   for(unsigned int frame = 0; frame < batchFrames; ++frame){
+      traceSetFrame(frame);
+      frameBoundary(frame);
+      uint64_t frameStart = nowNanoseconds();
+      {
+         TRACE_SCOPE(TRACE_PHYSICS);
+         integrateSatelites(allSatelites, totalSatelites);
+      }
+
+      uint64_t physicsDone = nowNanoseconds();
+      for(unsigned int k = 0; k < ensembleSize; ++k){
+         {
+            TRACE_SCOPE(TRACE_COLORING);
+            renderScene(scenes[k].satelites, scenes[k].pixels);
+         }
+         if(sinks){
+            TRACE_SCOPE(TRACE_RECORD);
+            frameSinkPush(sinks[k], (const float*)scenes[k].pixels);
+         }
+      }
+
+      uint64_t coloringDone = nowNanoseconds();
+      if(shouldValidate(frame)){
+         TRACE_SCOPE(TRACE_VALIDATION);
+         char label[64];
+         for(unsigned int k = 0; k < ensembleSize; ++k){
+            snprintf(label, sizeof(label), "Seed %u frame %u", scenes[k].seed, frame);
+            checkFrame(scenes[k].satelites, scenes[k].pixels, reference, frame, label);
          }
       }
-      pixels[i] = renderColor;
+      printf("Ensemble frame %u: %u scenes, satelite moving: %.1fms, space coloring: %.1fms.\n",
+         frame, ensembleSize,
+         nanosecondsToMilliseconds(physicsDone - frameStart),
+         nanosecondsToMilliseconds(coloringDone - physicsDone));
+      perfFrameReport(stdout, frame);
+      traceRecord(TRACE_FRAME, frameStart, nowNanoseconds());
+   }
+   double totalTime = nanosecondsToMilliseconds(nowNanoseconds() - startTime);
+   printf("Ensemble done: %u scenes x %u frames in %.1fms (%.2fms per scene frame).\n",
+      ensembleSize, batchFrames, totalTime,
+      totalTime / ((double)ensembleSize * batchFrames));
+
+   // Write the results
+   char path[4096];
+   int failed = 0;
+   for(unsigned int k = 0; sinks && k < ensembleSize; ++k){
+      failed |= frameSinkClose(sinks[k]) != 0;
+   }
+   free(sinks);
+   for(unsigned int k = 0; k < ensembleSize; ++k){
+      snprintf(path, sizeof(path), "%s/scene_%u.ppm", outputDirectory, scenes[k].seed);
+      if(writePPM(path, (const float*)scenes[k].pixels, WINDOW_WIDTH, WINDOW_HEIGHT)){
+         printf("Could not write %s\n", path);
+         failed = 1;
+      }
+   }
+   snprintf(path, sizeof(path), "%s/ensemble.csv", outputDirectory);
+   FILE* csv = fopen(path, "w");
+   if(csv){
+      fprintf(csv, "seed,satelite,position_x,position_y,velocity_x,velocity_y\n");
+      for(unsigned int k = 0; k < ensembleSize; ++k){
+         for(int i = 0; i < SATELITE_COUNT; ++i){
+            const satelite* s = &scenes[k].satelites[i];
+            fprintf(csv, "%u,%d,%.9g,%.9g,%.9g,%.9g\n", scenes[k].seed, i,
+               s->position.x, s->position.y, s->velocity.x, s->velocity.y);
+         }
+      }
+      fclose(csv);
+   } else {
+      printf("Could not write %s\n", path);
+      failed = 1;
+   }
+
+   reportFrameBuffer(scenes[0].pixels, "Frame buffer of the first scene");
+   for(unsigned int k = 0; k < ensembleSize; ++k){
+      freeFrameBuffer(scenes[k].pixels);
+   }
+   freeFrameBuffer(reference);
+   alignedFree(allSatelites, sizeof(satelite) * totalSatelites);
+   free(scenes);
+   validatorDestroy(frameValidator);
+   frameValidator = NULL;
+   arenaDestroyAll();
+   stopScheduler();
+   reportRoofline();
+   finishTrace();
+   printLargestError();
+   printAdaptiveStatistics();
+   if(validationFailures > 0){
+      printf("%u validation failures\n", validationFailures);
+      failed = 1;
+   }
+   if(allocatingFrames > 0){
+      printf("%u frames allocated memory in the frame loop\n", allocatingFrames);
+      failed = 1;
    }
+   return failed ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
 // ## You may add your own destrcution routines here ##
 void destroy(){
-
+   printLargestError();
+   printAdaptiveStatistics();
+   if(allocatingFrames > 0){
+      printf("%u frames allocated memory in the frame loop\n", allocatingFrames);
+   }
+   reportFrameBuffer(pixels, "Frame buffer");
+   if(frameSinkClose(recorder)){
+      printf("Recording %s is incomplete\n", recordPath);
+   }
+   recorder = NULL;
+   validatorDestroy(frameValidator);
+   frameValidator = NULL;
+   arenaDestroyAll();
+   stopScheduler();
+   reportRoofline();
+   finishTrace();
 
 }
 
@@ -273,11 +1507,8 @@ void destroy(){
 ////////////////////////////////////////////////
 
 // �� DO NOT EDIT THIS FUNCTION ��
-// Sequential rendering loop used for finding errors
-void sequentialGraphicsEngine(){
-
-    // Graphics pixel loop
-    for(int i = 0 ;i < SIZE; ++i) {
+// Sequential rendering of one pixel used for finding errors
+void sequentialPixel(const satelite* satelites, int i, color* out){
 
       // Row wise ordering
       floatvector pixel = {.x = i % WINDOW_WIDTH, .y = i / WINDOW_WIDTH};
@@ -333,7 +1564,16 @@ void sequentialGraphicsEngine(){
                                  weight / weights) * 3.0f;
          }
       }
-      correctPixels[i] = renderColor;
+      *out = renderColor;
+}
+
+// �� DO NOT EDIT THIS FUNCTION ��
+// Sequential rendering loop used for finding errors
+void sequentialGraphicsEngine(){
+
+    // Graphics pixel loop
+    for(int i = 0 ;i < SIZE; ++i) {
+      sequentialPixel(satelites, i, &correctPixels[i]);
     }
 }
 
@@ -401,63 +1641,77 @@ void sequentialPhysicsEngine(satelite *s){
 }
 
 // Just some value that barely passes for OpenCL example program
-#define ALLOWED_FP_ERROR 0.08
-// �� DO NOT EDIT THIS FUNCTION ��
+// (ALLOWED_FP_ERROR is defined at the top because the validator needs it)
+// Checks the parallel frame against the sequential reference renderer
+// and reports the error statistics instead of stopping at the first bad
+// pixel
 void errorCheck(){
-   for(unsigned int i=0; i < SIZE; ++i) {
-      if(fabs(correctPixels[i].red - pixels[i].red) > ALLOWED_FP_ERROR ||
-         fabs(correctPixels[i].green - pixels[i].green) > ALLOWED_FP_ERROR ||
-         fabs(correctPixels[i].blue - pixels[i].blue) > ALLOWED_FP_ERROR) {
-         printf("Buggy pixel at (x=%i, y=%i). Press enter to continue.\n", i % WINDOW_WIDTH, i / WINDOW_WIDTH);
-         getchar();
-         return;
-       }
-   }
-   printf("Error check passed!\n");
+   checkFrame(satelites, pixels, correctPixels, frameNumber, "Error check");
 }
 
 // �� DO NOT EDIT THIS FUNCTION ��
 void compute(void){
-   int timeSinceStart = glutGet(GLUT_ELAPSED_TIME);
+   uint64_t timeSinceStart = nowNanoseconds();
    previousFrameTimeSinceStart = timeSinceStart;
+   traceSetFrame(frameNumber);
 
    // Error check during first frames
    if (frameNumber < 2) {
+      TRACE_SCOPE(TRACE_VALIDATION);
       memcpy(backupSatelites, satelites, sizeof(satelite) * SATELITE_COUNT);
       sequentialPhysicsEngine(backupSatelites);
    }
-   parallelPhysicsEngine();
+
+   uint64_t sateliteMovementStart = nowNanoseconds();
+   {
+      TRACE_SCOPE(TRACE_PHYSICS);
+      parallelPhysicsEngine();
+   }
+   uint64_t sateliteMovementMoment = nowNanoseconds();
+   uint64_t sateliteMovementTime = sateliteMovementMoment - sateliteMovementStart;
+
    if (frameNumber < 2) {
+      TRACE_SCOPE(TRACE_VALIDATION);
       for (int i = 0; i < SATELITE_COUNT; i++) {
          if (memcmp (&satelites[i], &backupSatelites[i], sizeof(satelite))) {
             printf("Incorrect satelite data of satelite: %d\n", i);
-            getchar();
+            validationFailed();
          }
       }
    }
 
-   int sateliteMovementMoment = glutGet(GLUT_ELAPSED_TIME);
-   int sateliteMovementTime = sateliteMovementMoment  - timeSinceStart;
-
    // Decides the colors for the pixels
-   parallelGraphicsEngine();
-
-   int pixelColoringMoment = glutGet(GLUT_ELAPSED_TIME);
-   int pixelColoringTime =  pixelColoringMoment - sateliteMovementMoment;
+   uint64_t pixelColoringStart = nowNanoseconds();
+   {
+      TRACE_SCOPE(TRACE_COLORING);
+      parallelGraphicsEngine();
+   }
+   uint64_t pixelColoringMoment = nowNanoseconds();
+   uint64_t pixelColoringTime = pixelColoringMoment - pixelColoringStart;
 
    // Sequential code is used to check possible errors in the parallel version
-   if(frameNumber < 2){
-      sequentialGraphicsEngine();
+   if(shouldValidate(frameNumber)){
+      TRACE_SCOPE(TRACE_VALIDATION);
       errorCheck();
    }
 
-   int finishTime = glutGet(GLUT_ELAPSED_TIME);
+   // Recording happens in the background
+   if(recorder){
+      TRACE_SCOPE(TRACE_RECORD);
+      frameSinkPush(recorder, (const float*)pixels);
+   }
+
+   uint64_t finishTime = nowNanoseconds();
    // Print timings
-   int totalTime = finishTime - previousFinishTime;
+   uint64_t totalTime = finishTime - previousFinishTime;
+   traceRecord(TRACE_FRAME, previousFinishTime, finishTime);
    previousFinishTime = finishTime;
 
-   printf("Total frametime: %ims, satelite moving: %ims, space coloring: %ims.\n",
-      totalTime, sateliteMovementTime, pixelColoringTime);
+   printf("Total frametime: %.3fms, satelite moving: %.3fms, space coloring: %.3fms.\n",
+      nanosecondsToMilliseconds(totalTime),
+      nanosecondsToMilliseconds(sateliteMovementTime),
+      nanosecondsToMilliseconds(pixelColoringTime));
+   perfFrameReport(stdout, frameNumber);
 
    // Render the frame
    glutPostRedisplay();
@@ -477,18 +1731,24 @@ void fixedInit(unsigned int seed){
    }
 
    // Init pixel buffer which is rendered to the widow
-   pixels = (color*)malloc(sizeof(color) * SIZE);
+   pixels = allocateFrameBuffer();
 
    // Init pixel buffer which is used for error checking
-   correctPixels = (color*)malloc(sizeof(color) * SIZE);
+   correctPixels = allocateFrameBuffer();
 
-   backupSatelites = (satelite*)malloc(sizeof(satelite) * SATELITE_COUNT);
+   backupSatelites = (satelite*)alignedAllocate(sizeof(satelite) * SATELITE_COUNT,
+      ALLOC_CACHE_LINE);
 
 
    // Init satelites buffer which are moving in the space
-   satelites = (satelite*)malloc(sizeof(satelite) * SATELITE_COUNT);
+   satelites = (satelite*)alignedAllocate(sizeof(satelite) * SATELITE_COUNT,
+      ALLOC_CACHE_LINE);
 
-   // Create random satelites
+   initSatelites(satelites);
+}
+
+// Creates random satelites from the current rand() state
+void initSatelites(satelite* satelites){
    for(int i = 0; i < SATELITE_COUNT; ++i){
 
       // Random reddish color
@@ -529,9 +1789,9 @@ void fixedInit(unsigned int seed){
 void fixedDestroy(void){
    destroy();
 
-   free(pixels);
-   free(correctPixels);
-   free(satelites);
+   freeFrameBuffer(pixels);
+   freeFrameBuffer(correctPixels);
+   alignedFree(satelites, sizeof(satelite) * SATELITE_COUNT);
 
    if(seed != 0){
      printf("Used seed: %i\n", seed);
@@ -541,6 +1801,7 @@ void fixedDestroy(void){
 // �� DO NOT EDIT THIS FUNCTION ��
 // Renders pixels-buffer to the window 
 void render(void){
+   TRACE_SCOPE(TRACE_DISPLAY);
    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
    glDrawPixels(WINDOW_WIDTH, WINDOW_HEIGHT, GL_RGB, GL_FLOAT, pixels);
    glutSwapBuffers();
@@ -551,10 +1812,14 @@ void render(void){
 // Inits glut and start mainloop
 int main(int argc, char** argv){
 
-   if(argc > 1){
-     seed = atoi(argv[1]);
+   if(positionalArgument(argc, argv)){
+     seed = atoi(positionalArgument(argc, argv));
      printf("Using seed: %i\n", seed);
    }
+   parseArguments(argc, argv);
+   if(ensembleSize > 0){
+     return runEnsemble();
+   }
 
    // Init glut window
    glutInit(&argc, argv);
@@ -563,8 +1828,8 @@ int main(int argc, char** argv){
    glutCreateWindow("Parallelization excercise");
    glutDisplayFunc(render);
    atexit(fixedDestroy);
-   previousFrameTimeSinceStart = glutGet(GLUT_ELAPSED_TIME);
-   previousFinishTime = glutGet(GLUT_ELAPSED_TIME);
+   previousFrameTimeSinceStart = nowNanoseconds();
+   previousFinishTime = nowNanoseconds();
    glEnable(GL_DEPTH_TEST);
    glClearColor(0.0, 0.0, 0.0, 1.0);
    fixedInit(seed);
@@ -0,0 +1,413 @@
+// OpenCL transfer and launch microbenchmarks, one report per device.
+//
+// Compilation on linux:
+//   gcc -o clbench clbench.c -std=c99 -O2 -lOpenCL
+// Usage:
+//   ./clbench [--device=N] [--repeat=10] [--min-size=4096] [--max-size=67108864]
+//             [--saxpy-n=1048576] [--frame-bytes=12582912] [--csv=path]
+//
+// For every device (or only device N of the list it prints) it measures
+//   - write, read and map bandwidth of CL_MEM_USE_HOST_PTR and
+//     CL_MEM_ALLOC_HOST_PTR buffers over sizes from --min-size to
+//     --max-size, growing by 4x
+//   - the launch latency of an empty kernel (enqueue to clFinish), the
+//     launch rate when many are queued back to back, and a clFinish of
+//     an empty queue
+//   - the device bandwidth of the SAXPY kernel of hello.cu, from profiling
+//     events, checked like hello.cu does.
+// Every time is the best of --repeat runs. The report ends with the costs
+// of a frame of --frame-bytes (the 1024x1024 float RGB frame of
+// OpenCL/parallel.c by default): its readback against one launch and one
+// device pass over it at the SAXPY bandwidth, which tells whether frames
+// of that size are transfer bound or compute bound on the device.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define CL_TARGET_OPENCL_VERSION 200
+#define CL_USE_DEPRECATED_OPENCL_1_2_APIS
+#ifdef __APPLE__
+#include <OpenCL/opencl.h>
+#else
+#include <CL/cl.h>
+#endif
+
+#include "common/options.h"
+#include "common/clock.h"
+#include "common/alloc.h"
+#include "common/cl_probe.h"
+
+// Kernels launched this many times for the queued launch rate
+#define LAUNCH_BATCH 256
+
+static const char* benchSource =
+   "__kernel void empty(void){}\n"
+   "__kernel void saxpy(int n, float a, __global const float* x, __global float* y){\n"
+   "   int i = get_global_id(0);\n"
+   "   if(i < n) y[i] = a * x[i] + y[i];\n"
+   "}\n";
+
+typedef struct{
+   int repeat;
+   size_t minSize;
+   size_t maxSize;
+   int saxpyN;
+   size_t frameBytes;
+   FILE* csv;
+} benchSettings;
+
+// Best seconds of one bandwidth sweep point
+typedef struct{
+   size_t bytes;
+   double write;
+   double read;
+   double map;
+} transferTimes;
+
+#define MAX_SWEEP 32
+#define TRANSFER_MODES 2
+
+static const cl_mem_flags transferFlags[TRANSFER_MODES] = {CL_MEM_USE_HOST_PTR, CL_MEM_ALLOC_HOST_PTR};
+static const char* const transferNames[TRANSFER_MODES] = {"use_host_ptr", "alloc_host_ptr"};
+
+typedef struct{
+   transferTimes transfers[TRANSFER_MODES][MAX_SWEEP];
+   int sweepCount;
+   double launch;                   // empty kernel, enqueue to clFinish
+   double queuedLaunch;             // per kernel of LAUNCH_BATCH queued
+   double finish;                   // clFinish of an empty queue
+   double saxpy;                    // kernel run time from events
+   float saxpyError;
+} deviceResults;
+
+static inline double bestOf(double best, uint64_t start){
+   double seconds = (nowNanoseconds() - start) * 1e-9;
+   return best < 0 || seconds < best ? seconds : best;
+}
+
+static inline double gigabytesPerSecond(size_t bytes, double seconds){
+   return seconds > 0 ? bytes / seconds * 1e-9 : 0;
+}
+
+// Write, read and map times of a buffer of bytes made with flags. The host
+// side of the copies is page aligned, like the frame buffers. Returns 0 on
+// success.
+static int measureTransfers(cl_context context, cl_command_queue queue, cl_mem_flags flags,
+                            size_t bytes, int repeat, transferTimes* times){
+   void* host = alignedAllocate(bytes, ALLOC_PAGE);
+   void* backing = flags & CL_MEM_USE_HOST_PTR ? alignedAllocate(bytes, ALLOC_PAGE) : NULL;
+   cl_int status = CL_SUCCESS;
+   cl_mem buffer = NULL;
+   if(host && (backing || !(flags & CL_MEM_USE_HOST_PTR))){
+      memset(host, 1, bytes);
+      if(backing){
+         memset(backing, 0, bytes);
+      }
+      buffer = clCreateBuffer(context, CL_MEM_READ_WRITE | flags, bytes, backing, &status);
+   }
+   if(!buffer){
+      alignedFree(backing, bytes);
+      alignedFree(host, bytes);
+      return -1;
+   }
+
+   *times = (transferTimes){bytes, -1, -1, -1};
+   for(int r = 0; r < repeat && status == CL_SUCCESS; ++r){
+      uint64_t start = nowNanoseconds();
+      status = clEnqueueWriteBuffer(queue, buffer, CL_TRUE, 0, bytes, host, 0, NULL, NULL);
+      times->write = bestOf(times->write, start);
+
+      start = nowNanoseconds();
+      status |= clEnqueueReadBuffer(queue, buffer, CL_TRUE, 0, bytes, host, 0, NULL, NULL);
+      times->read = bestOf(times->read, start);
+
+      // A map for reading and writing and its unmap, as a frame would be
+      start = nowNanoseconds();
+      cl_int mapStatus;
+      void* mapped = clEnqueueMapBuffer(queue, buffer, CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0,
+         bytes, 0, NULL, NULL, &mapStatus);
+      status |= mapStatus;
+      if(mapStatus == CL_SUCCESS){
+         status |= clEnqueueUnmapMemObject(queue, buffer, mapped, 0, NULL, NULL);
+         status |= clFinish(queue);
+      }
+      times->map = bestOf(times->map, start);
+   }
+   clReleaseMemObject(buffer);
+   alignedFree(backing, bytes);
+   alignedFree(host, bytes);
+   return status == CL_SUCCESS ? 0 : -1;
+}
+
+// Empty kernel launches: one at a time, LAUNCH_BATCH queued, and clFinish
+// alone
+static int measureLaunches(cl_command_queue queue, cl_kernel empty, int repeat,
+                           deviceResults* results){
+   size_t global = 1;
+   cl_int status = CL_SUCCESS;
+   results->launch = results->queuedLaunch = results->finish = -1;
+   // The first launch pays for lazy setup in many runtimes
+   status |= clEnqueueNDRangeKernel(queue, empty, 1, NULL, &global, NULL, 0, NULL, NULL);
+   status |= clFinish(queue);
+   for(int r = 0; r < repeat && status == CL_SUCCESS; ++r){
+      uint64_t start = nowNanoseconds();
+      status |= clEnqueueNDRangeKernel(queue, empty, 1, NULL, &global, NULL, 0, NULL, NULL);
+      status |= clFinish(queue);
+      results->launch = bestOf(results->launch, start);
+
+      start = nowNanoseconds();
+      for(int k = 0; k < LAUNCH_BATCH; ++k){
+         status |= clEnqueueNDRangeKernel(queue, empty, 1, NULL, &global, NULL, 0, NULL, NULL);
+      }
+      status |= clFinish(queue);
+      results->queuedLaunch = bestOf(results->queuedLaunch, start);
+
+      start = nowNanoseconds();
+      status |= clFinish(queue);
+      results->finish = bestOf(results->finish, start);
+   }
+   results->queuedLaunch /= LAUNCH_BATCH;
+   return status == CL_SUCCESS ? 0 : -1;
+}
+
+// SAXPY of hello.cu: y = 2x + y on n floats in 256 wide work groups, which
+// reads two and writes one float per element
+static int measureSaxpy(cl_context context, cl_command_queue queue, cl_kernel saxpy, int n,
+                        int repeat, deviceResults* results){
+   size_t bytes = (size_t)n * sizeof(float);
+   float* x = (float*)alignedAllocate(bytes, ALLOC_PAGE);
+   float* y = (float*)alignedAllocate(bytes, ALLOC_PAGE);
+   cl_int status = CL_SUCCESS;
+   cl_mem dx = NULL, dy = NULL;
+   if(x && y){
+      for(int i = 0; i < n; i++){
+         x[i] = 1.0f;
+         y[i] = 2.0f;
+      }
+      dx = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, bytes, x, &status);
+      dy = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, bytes, y, &status);
+   }
+   if(!dx || !dy){
+      if(dx){
+         clReleaseMemObject(dx);
+      }
+      if(dy){
+         clReleaseMemObject(dy);
+      }
+      alignedFree(x, bytes);
+      alignedFree(y, bytes);
+      return -1;
+   }
+
+   float a = 2.0f;
+   size_t local = 256;
+   size_t global = (n + local - 1) / local * local;
+   status = clSetKernelArg(saxpy, 0, sizeof(int), &n);
+   status |= clSetKernelArg(saxpy, 1, sizeof(float), &a);
+   status |= clSetKernelArg(saxpy, 2, sizeof(cl_mem), &dx);
+   status |= clSetKernelArg(saxpy, 3, sizeof(cl_mem), &dy);
+   results->saxpy = -1;
+   for(int r = 0; r < repeat && status == CL_SUCCESS; ++r){
+      // y starts at 2 for every run, so the check below sees one run
+      status = clEnqueueWriteBuffer(queue, dy, CL_TRUE, 0, bytes, y, 0, NULL, NULL);
+      cl_event event;
+      status |= clEnqueueNDRangeKernel(queue, saxpy, 1, NULL, &global, &local, 0, NULL, &event);
+      if(status != CL_SUCCESS){
+         break;
+      }
+      cl_ulong begin = 0, end = 0;
+      clWaitForEvents(1, &event);
+      status |= clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(begin), &begin, NULL);
+      status |= clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(end), &end, NULL);
+      clReleaseEvent(event);
+      double seconds = (end - begin) * 1e-9;
+      if(results->saxpy < 0 || seconds < results->saxpy){
+         results->saxpy = seconds;
+      }
+   }
+   results->saxpyError = INFINITY;
+   if(status == CL_SUCCESS &&
+      clEnqueueReadBuffer(queue, dy, CL_TRUE, 0, bytes, x, 0, NULL, NULL) == CL_SUCCESS){
+      results->saxpyError = 0.0f;
+      for(int i = 0; i < n; i++){
+         results->saxpyError = fmaxf(results->saxpyError, fabsf(x[i] - 4.0f));
+      }
+   }
+   clReleaseMemObject(dx);
+   clReleaseMemObject(dy);
+   alignedFree(x, bytes);
+   alignedFree(y, bytes);
+   return status == CL_SUCCESS ? 0 : -1;
+}
+
+static void writeCSV(FILE* csv, int index, const char* test, const char* mode, size_t bytes,
+                     double seconds){
+   if(csv && seconds >= 0){
+      fprintf(csv, "%d,%s,%s,%zu,%.9f,%.3f\n", index, test, mode, bytes, seconds,
+         gigabytesPerSecond(bytes, seconds));
+   }
+}
+
+// The sweep point with at least bytes, the largest one if none is that big
+static const transferTimes* sweepPoint(const deviceResults* results, int mode, size_t bytes){
+   for(int s = 0; s < results->sweepCount; ++s){
+      if(results->transfers[mode][s].bytes >= bytes){
+         return &results->transfers[mode][s];
+      }
+   }
+   return &results->transfers[mode][results->sweepCount - 1];
+}
+
+static void report(int index, const clDeviceRecord* record, const deviceResults* results,
+                   const benchSettings* settings){
+   printf("Device %d: %s (%s, %s)\n", index, record->name, clProbeTypeName(record->type),
+      record->platformName);
+   printf("  %10s", "bytes");
+   for(int mode = 0; mode < TRANSFER_MODES; ++mode){
+      printf(" | %-14s write  read   map GB/s", transferNames[mode]);
+   }
+   printf("\n");
+   for(int s = 0; s < results->sweepCount; ++s){
+      printf("  %10zu", results->transfers[0][s].bytes);
+      for(int mode = 0; mode < TRANSFER_MODES; ++mode){
+         const transferTimes* t = &results->transfers[mode][s];
+         printf(" | %14s %6.2f %6.2f %6.2f     ", "", gigabytesPerSecond(t->bytes, t->write),
+            gigabytesPerSecond(t->bytes, t->read), gigabytesPerSecond(t->bytes, t->map));
+         writeCSV(settings->csv, index, "write", transferNames[mode], t->bytes, t->write);
+         writeCSV(settings->csv, index, "read", transferNames[mode], t->bytes, t->read);
+         writeCSV(settings->csv, index, "map", transferNames[mode], t->bytes, t->map);
+      }
+      printf("\n");
+   }
+   printf("  Empty kernel: %.1f us launch to finish, %.2f us each when %d are queued, "
+      "clFinish alone %.1f us\n", results->launch * 1e6, results->queuedLaunch * 1e6,
+      LAUNCH_BATCH, results->finish * 1e6);
+   writeCSV(settings->csv, index, "launch", "empty", 0, results->launch);
+   writeCSV(settings->csv, index, "queued_launch", "empty", 0, results->queuedLaunch);
+   writeCSV(settings->csv, index, "finish", "empty", 0, results->finish);
+
+   size_t saxpyBytes = 3 * (size_t)settings->saxpyN * sizeof(float);
+   double deviceBandwidth = gigabytesPerSecond(saxpyBytes, results->saxpy);
+   printf("  SAXPY of %d floats: %.3f ms, %.2f GB/s, max error %f\n", settings->saxpyN,
+      results->saxpy * 1e3, deviceBandwidth, results->saxpyError);
+   writeCSV(settings->csv, index, "saxpy", "kernel", saxpyBytes, results->saxpy);
+
+   // One device pass over the frame at the SAXPY bandwidth against its readback
+   double pass = deviceBandwidth > 0 ? settings->frameBytes / (deviceBandwidth * 1e9) : 0;
+   for(int mode = 0; mode < TRANSFER_MODES; ++mode){
+      const transferTimes* t = sweepPoint(results, mode, settings->frameBytes);
+      double read = t->read * settings->frameBytes / t->bytes;
+      printf("  Frame of %zu bytes with %s: read %.3f ms, launch %.3f ms, device pass %.3f ms, "
+         "%s bound\n", settings->frameBytes, transferNames[mode], read * 1e3,
+         results->launch * 1e3, pass * 1e3,
+         read + results->launch > pass ? "transfer" : "compute");
+   }
+}
+
+static int benchDevice(int index, const clDeviceRecord* record, const benchSettings* settings){
+   cl_int status;
+   cl_device_id device = record->device;
+   cl_context context = clCreateContext(NULL, 1, &device, NULL, NULL, &status);
+   if(status != CL_SUCCESS){
+      printf("Device %d: could not create a context (%d)\n", index, status);
+      return -1;
+   }
+   cl_command_queue queue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &status);
+   cl_program program = NULL;
+   cl_kernel empty = NULL, saxpy = NULL;
+   if(status == CL_SUCCESS){
+      program = clCreateProgramWithSource(context, 1, &benchSource, NULL, &status);
+   }
+   if(status == CL_SUCCESS){
+      status = clBuildProgram(program, 1, &device, NULL, NULL, NULL);
+   }
+   if(status == CL_SUCCESS){
+      empty = clCreateKernel(program, "empty", &status);
+   }
+   if(status == CL_SUCCESS){
+      saxpy = clCreateKernel(program, "saxpy", &status);
+   }
+
+   static deviceResults results;
+   memset(&results, 0, sizeof(results));
+   int failed = status != CL_SUCCESS;
+   size_t maxSize = settings->maxSize;
+   if(record->maxAllocation && maxSize > record->maxAllocation){
+      maxSize = record->maxAllocation;
+   }
+   for(size_t bytes = settings->minSize; !failed && bytes <= maxSize &&
+       results.sweepCount < MAX_SWEEP; bytes *= 4){
+      for(int mode = 0; mode < TRANSFER_MODES && !failed; ++mode){
+         failed = measureTransfers(context, queue, transferFlags[mode], bytes, settings->repeat,
+            &results.transfers[mode][results.sweepCount]) != 0;
+      }
+      results.sweepCount++;
+   }
+   failed = failed || results.sweepCount == 0 ||
+      measureLaunches(queue, empty, settings->repeat, &results) != 0 ||
+      measureSaxpy(context, queue, saxpy, settings->saxpyN, settings->repeat, &results) != 0;
+   if(failed){
+      printf("Device %d (%s): a measurement failed\n", index, record->name);
+   } else {
+      report(index, record, &results, settings);
+   }
+
+   if(saxpy){
+      clReleaseKernel(saxpy);
+   }
+   if(empty){
+      clReleaseKernel(empty);
+   }
+   if(program){
+      clReleaseProgram(program);
+   }
+   if(queue){
+      clReleaseCommandQueue(queue);
+   }
+   clReleaseContext(context);
+   return failed ? -1 : 0;
+}
+
+int main(int argc, char** argv){
+   benchSettings settings = {
+      .repeat = (int)optionLong(argc, argv, "repeat", 10),
+      .minSize = (size_t)optionLong(argc, argv, "min-size", 4096),
+      .maxSize = (size_t)optionLong(argc, argv, "max-size", 64 << 20),
+      .saxpyN = (int)optionLong(argc, argv, "saxpy-n", 1 << 20),
+      .frameBytes = (size_t)optionLong(argc, argv, "frame-bytes", 1024 * 1024 * 3 * sizeof(float)),
+      .csv = NULL
+   };
+   if(settings.repeat < 1 || settings.minSize == 0 || settings.saxpyN < 1 ||
+      settings.frameBytes == 0){
+      printf("--repeat, --min-size, --saxpy-n and --frame-bytes must be positive\n");
+      return EXIT_FAILURE;
+   }
+   const char* csvPath = optionValue(argc, argv, "csv");
+   if(csvPath){
+      settings.csv = fopen(csvPath, "w");
+      if(!settings.csv){
+         printf("Could not write %s\n", csvPath);
+         return EXIT_FAILURE;
+      }
+      fprintf(settings.csv, "device,test,mode,bytes,seconds,gb_per_second\n");
+   }
+
+   static clProbe probe;
+   if(clProbeDevices(&probe) == 0){
+      printf("No OpenCL devices\n");
+      return EXIT_FAILURE;
+   }
+   long only = optionLong(argc, argv, "device", -1);
+   int failures = 0;
+   for(int d = 0; d < probe.count; ++d){
+      if(only < 0 || only == d){
+         failures += benchDevice(d, &probe.devices[d], &settings) != 0;
+      }
+   }
+   if(settings.csv){
+      fclose(settings.csv);
+   }
+   return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
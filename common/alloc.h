@@ -0,0 +1,162 @@
+// Aligned buffer allocation with huge pages for the large buffers.
+//
+// Every buffer starts on a cache line (or a larger requested alignment),
+// so vector loads and stores of a row never split a line. Buffers of at
+// least ALLOC_HUGE_PAGE bytes (the 12 MB frame buffers) are mapped
+// directly and backed, depending on allocMode, by
+//   - ALLOC_EXPLICIT: MAP_HUGETLB pages from the reserved pool
+//     (/proc/sys/vm/nr_hugepages), with a warning and the transparent
+//     backing when the pool is too small
+//   - ALLOC_TRANSPARENT: an anonymous mapping aligned to 2 MB with
+//     madvise(MADV_HUGEPAGE), so the kernel can use transparent huge pages
+//   - ALLOC_AUTO (default): explicit, falling back to transparent
+//   - ALLOC_OFF: a plain mapping with 4 KB pages.
+// One 2 MB page maps what 512 small pages do, so a frame buffer needs 6
+// TLB entries instead of 3072. Large buffers are untouched when returned,
+// so the caller still decides which node first touches them.
+//
+// alignedFree() takes the size that was allocated, like munmap().
+#ifndef ALLOC_H
+#define ALLOC_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define ALLOC_CACHE_LINE 64
+#define ALLOC_PAGE 4096
+#define ALLOC_HUGE_PAGE (2u << 20)
+
+typedef enum{
+   ALLOC_AUTO,
+   ALLOC_EXPLICIT,
+   ALLOC_TRANSPARENT,
+   ALLOC_OFF
+} allocMode;
+
+typedef struct{
+   allocMode mode;
+   // Number of large buffers by backing
+   unsigned int explicitHuge;
+   unsigned int transparentHuge;
+   unsigned int smallPages;
+   size_t largeBytes;
+} allocState;
+
+static allocState allocGlobal = {.mode = ALLOC_AUTO};
+
+// Parses "auto", "explicit", "transparent" or "off". Returns 0 on success.
+static inline int allocSetMode(const char* mode){
+   if(!mode || strcmp(mode, "auto") == 0){
+      allocGlobal.mode = ALLOC_AUTO;
+   } else if(strcmp(mode, "explicit") == 0){
+      allocGlobal.mode = ALLOC_EXPLICIT;
+   } else if(strcmp(mode, "transparent") == 0){
+      allocGlobal.mode = ALLOC_TRANSPARENT;
+   } else if(strcmp(mode, "off") == 0){
+      allocGlobal.mode = ALLOC_OFF;
+   } else {
+      printf("Unknown --huge-pages=%s, expected auto, explicit, transparent or off\n", mode);
+      return -1;
+   }
+   return 0;
+}
+
+static inline int allocIsLarge(size_t bytes){
+   return bytes >= ALLOC_HUGE_PAGE;
+}
+
+// Size of the pages backing a buffer of bytes, for splitting it between
+// threads without sharing a page
+static inline size_t allocGranularity(size_t bytes){
+   return allocIsLarge(bytes) && allocGlobal.mode != ALLOC_OFF ? ALLOC_HUGE_PAGE : ALLOC_PAGE;
+}
+
+// Mapped length of a large buffer
+static inline size_t allocMappedSize(size_t bytes){
+   size_t granularity = allocGranularity(bytes);
+   return (bytes + granularity - 1) / granularity * granularity;
+}
+
+static inline void* allocMapLarge(size_t bytes){
+   size_t size = allocMappedSize(bytes);
+   void* memory;
+#ifdef MAP_HUGETLB
+   if(allocGlobal.mode == ALLOC_AUTO || allocGlobal.mode == ALLOC_EXPLICIT){
+      memory = mmap(NULL, size, PROT_READ | PROT_WRITE,
+         MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+      if(memory != MAP_FAILED){
+         allocGlobal.explicitHuge++;
+         return memory;
+      }
+      if(allocGlobal.mode == ALLOC_EXPLICIT){
+         printf("No explicit huge pages for %zu bytes, see /proc/sys/vm/nr_hugepages\n", size);
+      }
+   }
+#endif
+   if(allocGlobal.mode == ALLOC_OFF){
+      memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      allocGlobal.smallPages += memory != MAP_FAILED;
+      return memory == MAP_FAILED ? NULL : memory;
+   }
+
+   // Over-map by one huge page and trim to a 2 MB aligned range
+   char* mapping = (char*)mmap(NULL, size + ALLOC_HUGE_PAGE, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if(mapping == MAP_FAILED){
+      return NULL;
+   }
+   char* aligned = (char*)(((uintptr_t)mapping + ALLOC_HUGE_PAGE - 1) &
+      ~(uintptr_t)(ALLOC_HUGE_PAGE - 1));
+   if(aligned > mapping){
+      munmap(mapping, aligned - mapping);
+   }
+   munmap(aligned + size, mapping + ALLOC_HUGE_PAGE - aligned);
+#ifdef MADV_HUGEPAGE
+   if(madvise(aligned, size, MADV_HUGEPAGE) == 0){
+      allocGlobal.transparentHuge++;
+      return aligned;
+   }
+#endif
+   allocGlobal.smallPages++;
+   return aligned;
+}
+
+// Returns a buffer aligned to alignment (at least a cache line), or NULL
+static inline void* alignedAllocate(size_t bytes, size_t alignment){
+   if(allocIsLarge(bytes)){
+      void* memory = allocMapLarge(bytes);
+      allocGlobal.largeBytes += memory ? allocMappedSize(bytes) : 0;
+      return memory;
+   }
+   void* memory = NULL;
+   if(alignment < ALLOC_CACHE_LINE){
+      alignment = ALLOC_CACHE_LINE;
+   }
+   // Whole lines, so the next allocation does not share the last one
+   size_t size = (bytes + ALLOC_CACHE_LINE - 1) / ALLOC_CACHE_LINE * ALLOC_CACHE_LINE;
+   return posix_memalign(&memory, alignment, size ? size : ALLOC_CACHE_LINE) == 0 ?
+      memory : NULL;
+}
+
+static inline void alignedFree(void* memory, size_t bytes){
+   if(!memory){
+      return;
+   }
+   if(allocIsLarge(bytes)){
+      munmap(memory, allocMappedSize(bytes));
+   } else {
+      free(memory);
+   }
+}
+
+static inline void allocPrintStatistics(FILE* out){
+   fprintf(out, "Large buffers: %u on explicit huge pages, %u advised for transparent "
+      "huge pages, %u on 4 KB pages, %.1f MB mapped\n",
+      allocGlobal.explicitHuge, allocGlobal.transparentHuge, allocGlobal.smallPages,
+      allocGlobal.largeBytes / 1e6);
+}
+
+#endif
@@ -0,0 +1,212 @@
+// OpenCL program builds with a binary cache in memory and on disk.
+//
+// Programs are specialized by -D build options, so every configuration is
+// its own program. clBuildCached() keys a build by a 64 bit FNV-1a hash of
+// the source, the options and the device name, device version and driver
+// version, and looks for the binary
+//   - in memory, so further contexts on the same device in this process
+//     (calibration, band devices) skip the compiler
+//   - in clBuildGlobal.directory/<key>.clbin, if a directory was set, so
+//     later runs skip it too.
+// A binary the runtime rejects is rebuilt from source and replaced. The
+// directory must exist; a binary that cannot be written is only reported.
+//
+// The caller includes the OpenCL headers first.
+#ifndef CL_BUILD_H
+#define CL_BUILD_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CL_BUILD_MAX_CACHED 16
+
+typedef struct{
+   uint64_t key;
+   unsigned char* binary;
+   size_t size;
+} clCachedBinary;
+
+typedef struct{
+   const char* directory;           // NULL keeps binaries in memory only
+   clCachedBinary cached[CL_BUILD_MAX_CACHED];
+   int cachedCount;
+   // Statistics
+   unsigned int memoryHits;
+   unsigned int diskHits;
+   unsigned int compiles;
+} clBuildState;
+
+static clBuildState clBuildGlobal;
+
+static inline uint64_t clBuildHash(uint64_t hash, const void* data, size_t size){
+   const unsigned char* bytes = (const unsigned char*)data;
+   for(size_t i = 0; i < size; ++i){
+      hash = (hash ^ bytes[i]) * 1099511628211ull;
+   }
+   return hash;
+}
+
+static inline uint64_t clBuildKey(cl_device_id device, const char* source, size_t sourceSize,
+                                  const char* options){
+   uint64_t key = clBuildHash(14695981039346656037ull, source, sourceSize);
+   key = clBuildHash(key, options, strlen(options) + 1);
+   const cl_device_info fields[3] = {CL_DEVICE_NAME, CL_DEVICE_VERSION, CL_DRIVER_VERSION};
+   for(int f = 0; f < 3; ++f){
+      char text[256] = "";
+      clGetDeviceInfo(device, fields[f], sizeof(text) - 1, text, NULL);
+      key = clBuildHash(key, text, strlen(text) + 1);
+   }
+   return key;
+}
+
+static inline void clBuildPath(uint64_t key, char* path, size_t size){
+   snprintf(path, size, "%s/%016llx.clbin", clBuildGlobal.directory, (unsigned long long)key);
+}
+
+// The cached binary of key, loading it from disk (and setting fromDisk)
+// if needed. NULL if there is none.
+static inline clCachedBinary* clBuildFind(uint64_t key, int* fromDisk){
+   for(int c = 0; c < clBuildGlobal.cachedCount; ++c){
+      if(clBuildGlobal.cached[c].key == key){
+         return &clBuildGlobal.cached[c];
+      }
+   }
+   if(!clBuildGlobal.directory || clBuildGlobal.cachedCount == CL_BUILD_MAX_CACHED){
+      return NULL;
+   }
+   char path[4096];
+   clBuildPath(key, path, sizeof(path));
+   FILE* file = fopen(path, "rb");
+   if(!file){
+      return NULL;
+   }
+   clCachedBinary* entry = &clBuildGlobal.cached[clBuildGlobal.cachedCount];
+   fseek(file, 0, SEEK_END);
+   long size = ftell(file);
+   fseek(file, 0, SEEK_SET);
+   entry->binary = size > 0 ? (unsigned char*)malloc(size) : NULL;
+   if(!entry->binary || fread(entry->binary, 1, size, file) != (size_t)size){
+      free(entry->binary);
+      fclose(file);
+      return NULL;
+   }
+   fclose(file);
+   entry->key = key;
+   entry->size = (size_t)size;
+   clBuildGlobal.cachedCount++;
+   *fromDisk = 1;
+   return entry;
+}
+
+// Keeps the binary of a freshly compiled program, and writes it to disk
+static inline void clBuildStore(uint64_t key, cl_program program){
+   size_t size = 0;
+   if(clBuildGlobal.cachedCount == CL_BUILD_MAX_CACHED ||
+      clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(size), &size, NULL) != CL_SUCCESS ||
+      size == 0){
+      return;
+   }
+   unsigned char* binary = (unsigned char*)malloc(size);
+   if(!binary || clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(binary), &binary, NULL) != CL_SUCCESS){
+      free(binary);
+      return;
+   }
+   clBuildGlobal.cached[clBuildGlobal.cachedCount++] = (clCachedBinary){key, binary, size};
+   if(!clBuildGlobal.directory){
+      return;
+   }
+   char path[4096];
+   clBuildPath(key, path, sizeof(path));
+   FILE* file = fopen(path, "wb");
+   if(!file || fwrite(binary, 1, size, file) != size){
+      printf("Could not write program binary %s\n", path);
+   }
+   if(file){
+      fclose(file);
+   }
+}
+
+// Drops a binary the runtime rejected, so it gets replaced
+static inline void clBuildForget(clCachedBinary* entry){
+   *entry = clBuildGlobal.cached[--clBuildGlobal.cachedCount];
+}
+
+static inline void clBuildPrintLog(cl_program program, cl_device_id device){
+   size_t size = 0;
+   clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, 0, NULL, &size);
+   char* log = (char*)malloc(size + 1);
+   if(!log){
+      return;
+   }
+   clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, size, log, NULL);
+   log[size] = '\0';
+   printf("%s\n", log);
+   free(log);
+}
+
+// Builds source with options for device in context, from a cached binary
+// when there is one. Prints the build log and returns NULL on failure.
+static inline cl_program clBuildCached(cl_context context, cl_device_id device,
+                                       const char* source, size_t sourceSize,
+                                       const char* options){
+   uint64_t key = clBuildKey(device, source, sourceSize, options);
+   int fromDisk = 0;
+   clCachedBinary* entry = clBuildFind(key, &fromDisk);
+   cl_int status;
+   if(entry){
+      const unsigned char* binary = entry->binary;
+      cl_int binaryStatus;
+      cl_program program = clCreateProgramWithBinary(context, 1, &device, &entry->size,
+         &binary, &binaryStatus, &status);
+      if(status == CL_SUCCESS && binaryStatus == CL_SUCCESS &&
+         clBuildProgram(program, 1, &device, options, NULL, NULL) == CL_SUCCESS){
+         if(fromDisk){
+            clBuildGlobal.diskHits++;
+         } else {
+            clBuildGlobal.memoryHits++;
+         }
+         return program;
+      }
+      if(status == CL_SUCCESS){
+         clReleaseProgram(program);
+      }
+      free(entry->binary);
+      clBuildForget(entry);
+   }
+
+   cl_program program = clCreateProgramWithSource(context, 1, &source, &sourceSize, &status);
+   if(status != CL_SUCCESS){
+      printf("Could not create program (%d)\n", status);
+      return NULL;
+   }
+   status = clBuildProgram(program, 1, &device, options, NULL, NULL);
+   if(status != CL_SUCCESS){
+      printf("Build program failed (%d) with %s\n", status, options);
+      clBuildPrintLog(program, device);
+      clReleaseProgram(program);
+      return NULL;
+   }
+   clBuildGlobal.compiles++;
+   clBuildStore(key, program);
+   return program;
+}
+
+static inline void clBuildPrintStatistics(FILE* out){
+   fprintf(out, "Program builds: %u compiled, %u from memory", clBuildGlobal.compiles,
+      clBuildGlobal.memoryHits);
+   if(clBuildGlobal.directory){
+      fprintf(out, ", %u from %s", clBuildGlobal.diskHits, clBuildGlobal.directory);
+   }
+   fprintf(out, "\n");
+}
+
+static inline void clBuildDestroy(void){
+   for(int c = 0; c < clBuildGlobal.cachedCount; ++c){
+      free(clBuildGlobal.cached[c].binary);
+   }
+   clBuildGlobal.cachedCount = 0;
+}
+
+#endif
@@ -0,0 +1,210 @@
+// OpenCL device discovery: one record per device of every platform with
+// the attributes the engines tune for, so device and kernel choices are
+// made from data instead of taking the first device.
+//
+// clProbeDevices() fills a clProbe, clProbePick() chooses the strongest
+// device of a type (compute units x clock), clProbeLocalSize() a work
+// group for a row of the window, and clProbeWriteJSON() dumps the records
+// for inventories. clProbeRecord() describes a single device, sub-devices
+// included. Everything is copied into the records, nothing has to be
+// freed.
+//
+// The caller includes the OpenCL headers first.
+#ifndef CL_PROBE_H
+#define CL_PROBE_H
+
+#include <stdio.h>
+#include <string.h>
+
+#define CL_PROBE_MAX_PLATFORMS 16
+#define CL_PROBE_MAX_DEVICES 64
+#define CL_PROBE_TEXT 256
+
+typedef struct{
+   cl_platform_id platform;
+   cl_device_id device;
+   char platformName[CL_PROBE_TEXT];
+   char platformVersion[CL_PROBE_TEXT];
+   char name[CL_PROBE_TEXT];
+   char vendor[CL_PROBE_TEXT];
+   char version[CL_PROBE_TEXT];         // "OpenCL 1.2 ..."
+   char driverVersion[CL_PROBE_TEXT];
+   char openclCVersion[CL_PROBE_TEXT];
+   cl_device_type type;
+   cl_uint computeUnits;
+   cl_uint clockMHz;
+   size_t maxWorkGroupSize;
+   size_t maxWorkItemSizes[3];
+   cl_ulong localMemory;
+   cl_ulong globalMemory;
+   cl_ulong maxAllocation;
+   cl_uint preferredVectorFloat;
+   cl_uint preferredVectorDouble;
+   int fp64;
+   int unifiedMemory;                   // shares memory with the host
+   int imageSupport;
+   cl_bitfield svmCapabilities;         // 0 before OpenCL 2.0
+} clDeviceRecord;
+
+typedef struct{
+   int count;
+   clDeviceRecord devices[CL_PROBE_MAX_DEVICES];
+} clProbe;
+
+static inline const char* clProbeTypeName(cl_device_type type){
+   return (type & CL_DEVICE_TYPE_GPU) ? "gpu" :
+          (type & CL_DEVICE_TYPE_CPU) ? "cpu" :
+          (type & CL_DEVICE_TYPE_ACCELERATOR) ? "accelerator" : "other";
+}
+
+static inline void clProbeText(cl_device_id device, cl_device_info field, char* text){
+   text[0] = '\0';
+   clGetDeviceInfo(device, field, CL_PROBE_TEXT - 1, text, NULL);
+   text[CL_PROBE_TEXT - 1] = '\0';
+}
+
+static inline void clProbeRecord(cl_platform_id platform, cl_device_id device, clDeviceRecord* r){
+   memset(r, 0, sizeof(*r));
+   r->platform = platform;
+   r->device = device;
+   clGetPlatformInfo(platform, CL_PLATFORM_NAME, CL_PROBE_TEXT - 1, r->platformName, NULL);
+   clGetPlatformInfo(platform, CL_PLATFORM_VERSION, CL_PROBE_TEXT - 1, r->platformVersion, NULL);
+   clProbeText(device, CL_DEVICE_NAME, r->name);
+   clProbeText(device, CL_DEVICE_VENDOR, r->vendor);
+   clProbeText(device, CL_DEVICE_VERSION, r->version);
+   clProbeText(device, CL_DRIVER_VERSION, r->driverVersion);
+   clProbeText(device, CL_DEVICE_OPENCL_C_VERSION, r->openclCVersion);
+   clGetDeviceInfo(device, CL_DEVICE_TYPE, sizeof(r->type), &r->type, NULL);
+   clGetDeviceInfo(device, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(r->computeUnits), &r->computeUnits, NULL);
+   clGetDeviceInfo(device, CL_DEVICE_MAX_CLOCK_FREQUENCY, sizeof(r->clockMHz), &r->clockMHz, NULL);
+   clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(r->maxWorkGroupSize), &r->maxWorkGroupSize, NULL);
+   clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_ITEM_SIZES, sizeof(r->maxWorkItemSizes), r->maxWorkItemSizes, NULL);
+   clGetDeviceInfo(device, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(r->localMemory), &r->localMemory, NULL);
+   clGetDeviceInfo(device, CL_DEVICE_GLOBAL_MEM_SIZE, sizeof(r->globalMemory), &r->globalMemory, NULL);
+   clGetDeviceInfo(device, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(r->maxAllocation), &r->maxAllocation, NULL);
+   clGetDeviceInfo(device, CL_DEVICE_PREFERRED_VECTOR_WIDTH_FLOAT, sizeof(cl_uint), &r->preferredVectorFloat, NULL);
+   clGetDeviceInfo(device, CL_DEVICE_PREFERRED_VECTOR_WIDTH_DOUBLE, sizeof(cl_uint), &r->preferredVectorDouble, NULL);
+
+   cl_bitfield doubleConfig = 0;
+   clGetDeviceInfo(device, CL_DEVICE_DOUBLE_FP_CONFIG, sizeof(doubleConfig), &doubleConfig, NULL);
+   r->fp64 = doubleConfig != 0;
+   cl_bool flag = CL_FALSE;
+   // Deprecated in 2.0 but still answered, CPU and integrated devices say yes
+   clGetDeviceInfo(device, CL_DEVICE_HOST_UNIFIED_MEMORY, sizeof(flag), &flag, NULL);
+   r->unifiedMemory = flag == CL_TRUE;
+   flag = CL_FALSE;
+   clGetDeviceInfo(device, CL_DEVICE_IMAGE_SUPPORT, sizeof(flag), &flag, NULL);
+   r->imageSupport = flag == CL_TRUE;
+   if(strncmp(r->version, "OpenCL 1.", 9) != 0){
+      clGetDeviceInfo(device, CL_DEVICE_SVM_CAPABILITIES, sizeof(r->svmCapabilities),
+         &r->svmCapabilities, NULL);
+   }
+}
+
+// Records every device of every platform. Returns the count.
+static inline int clProbeDevices(clProbe* probe){
+   cl_platform_id platforms[CL_PROBE_MAX_PLATFORMS];
+   cl_uint platformCount = 0;
+   probe->count = 0;
+   if(clGetPlatformIDs(CL_PROBE_MAX_PLATFORMS, platforms, &platformCount) != CL_SUCCESS){
+      return 0;
+   }
+   for(cl_uint p = 0; p < platformCount && p < CL_PROBE_MAX_PLATFORMS; ++p){
+      cl_device_id devices[CL_PROBE_MAX_DEVICES];
+      cl_uint deviceCount = 0;
+      if(clGetDeviceIDs(platforms[p], CL_DEVICE_TYPE_ALL, CL_PROBE_MAX_DEVICES, devices,
+                        &deviceCount) != CL_SUCCESS){
+         continue;
+      }
+      for(cl_uint d = 0; d < deviceCount && d < CL_PROBE_MAX_DEVICES &&
+          probe->count < CL_PROBE_MAX_DEVICES; ++d){
+         clProbeRecord(platforms[p], devices[d], &probe->devices[probe->count++]);
+      }
+   }
+   return probe->count;
+}
+
+// The device of type with the most compute units x clock, only among
+// those with double precision if needFp64. NULL if there is none.
+static inline const clDeviceRecord* clProbePick(const clProbe* probe, cl_device_type type,
+                                                int needFp64){
+   const clDeviceRecord* best = NULL;
+   for(int d = 0; d < probe->count; ++d){
+      const clDeviceRecord* r = &probe->devices[d];
+      if(!(r->type & type) || (needFp64 && !r->fp64)){
+         continue;
+      }
+      if(!best || (double)r->computeUnits * r->clockMHz >
+                  (double)best->computeUnits * best->clockMHz){
+         best = r;
+      }
+   }
+   return best;
+}
+
+// Work group of one row by the largest power of two that the device
+// allows and that divides width: {1, columns}
+static inline void clProbeLocalSize(const clDeviceRecord* r, size_t width, size_t localSize[2]){
+   size_t limit = r->maxWorkGroupSize;
+   if(r->maxWorkItemSizes[1] && r->maxWorkItemSizes[1] < limit){
+      limit = r->maxWorkItemSizes[1];
+   }
+   size_t columns = 1;
+   while(columns * 2 <= limit && width % (columns * 2) == 0){
+      columns *= 2;
+   }
+   localSize[0] = 1;
+   localSize[1] = columns;
+}
+
+static inline void clProbeWriteString(FILE* out, const char* text){
+   fputc('"', out);
+   for(; *text; ++text){
+      if(*text == '"' || *text == '\\'){
+         fprintf(out, "\\%c", *text);
+      } else if((unsigned char)*text < 0x20){
+         fprintf(out, "\\u%04x", (unsigned char)*text);
+      } else {
+         fputc(*text, out);
+      }
+   }
+   fputc('"', out);
+}
+
+// All records as a JSON array of objects
+static inline void clProbeWriteJSON(FILE* out, const clProbe* probe){
+   fprintf(out, "[");
+   for(int d = 0; d < probe->count; ++d){
+      const clDeviceRecord* r = &probe->devices[d];
+      fprintf(out, "%s\n  {\"platform\": ", d > 0 ? "," : "");
+      clProbeWriteString(out, r->platformName);
+      fprintf(out, ", \"platform_version\": ");
+      clProbeWriteString(out, r->platformVersion);
+      fprintf(out, ", \"name\": ");
+      clProbeWriteString(out, r->name);
+      fprintf(out, ", \"vendor\": ");
+      clProbeWriteString(out, r->vendor);
+      fprintf(out, ", \"type\": \"%s\", \"version\": ", clProbeTypeName(r->type));
+      clProbeWriteString(out, r->version);
+      fprintf(out, ", \"driver_version\": ");
+      clProbeWriteString(out, r->driverVersion);
+      fprintf(out, ", \"opencl_c_version\": ");
+      clProbeWriteString(out, r->openclCVersion);
+      fprintf(out, ",\n   \"compute_units\": %u, \"clock_mhz\": %u, \"max_work_group_size\": %zu, "
+         "\"max_work_item_sizes\": [%zu, %zu, %zu],\n   \"local_memory\": %llu, "
+         "\"global_memory\": %llu, \"max_allocation\": %llu,\n   "
+         "\"preferred_vector_width_float\": %u, \"preferred_vector_width_double\": %u, "
+         "\"fp64\": %s, \"unified_memory\": %s, \"image_support\": %s, "
+         "\"svm_coarse_grain\": %s, \"svm_fine_grain\": %s}",
+         r->computeUnits, r->clockMHz, r->maxWorkGroupSize, r->maxWorkItemSizes[0],
+         r->maxWorkItemSizes[1], r->maxWorkItemSizes[2], (unsigned long long)r->localMemory,
+         (unsigned long long)r->globalMemory, (unsigned long long)r->maxAllocation,
+         r->preferredVectorFloat, r->preferredVectorDouble, r->fp64 ? "true" : "false",
+         r->unifiedMemory ? "true" : "false", r->imageSupport ? "true" : "false",
+         (r->svmCapabilities & CL_DEVICE_SVM_COARSE_GRAIN_BUFFER) ? "true" : "false",
+         (r->svmCapabilities & CL_DEVICE_SVM_FINE_GRAIN_BUFFER) ? "true" : "false");
+   }
+   fprintf(out, "\n]\n");
+}
+
+#endif
@@ -0,0 +1,171 @@
+// OpenCL command profiling through CL_QUEUE_PROFILING_ENABLE events.
+//
+// Queues made with clProfileQueueProperties() record four device times
+// for every command that gets an event:
+//    QUEUED  the host enqueued it
+//    SUBMIT  the runtime handed it to the device
+//    START   the device started it
+//    END     the device finished it
+// Enqueue calls pass clProfileNext(type) as their event argument, which is
+// NULL while profiling is off, so the calls are unchanged without it.
+// Events are kept until clProfileCollect(), which waits for them and adds
+// queued (SUBMIT - QUEUED), submit (START - SUBMIT) and run (END - START)
+// time to the totals of their command type. clProfileFrameReport() prints
+// what was collected since its previous call, clProfileSummary() all of it.
+//
+// The caller includes the OpenCL headers first.
+#ifndef CL_PROFILE_H
+#define CL_PROFILE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Events waiting for clProfileCollect(), it runs early when they fill up
+#define CL_PROFILE_MAX_PENDING 1024
+
+typedef enum{
+   CL_PROFILE_WRITE,
+   CL_PROFILE_PHYSICS_KERNEL,
+   CL_PROFILE_GRAPHICS_KERNEL,
+   CL_PROFILE_HELPER_KERNEL,        // jump flooding and disc stamping
+   CL_PROFILE_READ,
+   CL_PROFILE_TYPE_COUNT
+} clProfileType;
+
+static const char* const clProfileTypeNames[CL_PROFILE_TYPE_COUNT] = {
+   "write", "physics kernel", "graphics kernel", "helper kernels", "read"
+};
+
+typedef struct{
+   uint64_t commands;
+   uint64_t queued;                 // nanoseconds, summed over commands
+   uint64_t submit;
+   uint64_t run;
+   uint64_t longestRun;
+} clProfileTotals;
+
+typedef struct{
+   int enabled;
+   cl_event pending[CL_PROFILE_MAX_PENDING];
+   clProfileType pendingType[CL_PROFILE_MAX_PENDING];
+   int pendingCount;
+   clProfileTotals totals[CL_PROFILE_TYPE_COUNT];
+   // Totals at the previous clProfileFrameReport(), for per frame deltas
+   clProfileTotals reported[CL_PROFILE_TYPE_COUNT];
+   uint64_t failed;                 // events without profiling info
+} clProfileState;
+
+static clProfileState clProfileGlobal;
+
+static inline void clProfileInit(void){
+   clProfileGlobal.enabled = 1;
+}
+
+// Properties for clCreateCommandQueue()
+static inline cl_command_queue_properties clProfileQueueProperties(void){
+   return clProfileGlobal.enabled ? CL_QUEUE_PROFILING_ENABLE : 0;
+}
+
+// Waits for every pending event and adds its times to the totals
+static inline void clProfileCollect(void){
+   for(int e = 0; e < clProfileGlobal.pendingCount; ++e){
+      cl_event event = clProfileGlobal.pending[e];
+      cl_ulong queued = 0, submit = 0, start = 0, end = 0;
+      cl_int result = clWaitForEvents(1, &event);
+      result |= clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_QUEUED, sizeof(queued), &queued, NULL);
+      result |= clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_SUBMIT, sizeof(submit), &submit, NULL);
+      result |= clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(start), &start, NULL);
+      result |= clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(end), &end, NULL);
+      clReleaseEvent(event);
+      // Some runtimes leave out a stamp, count those instead of adding garbage
+      if(result != CL_SUCCESS || submit < queued || start < submit || end < start){
+         clProfileGlobal.failed++;
+         continue;
+      }
+      clProfileTotals* t = &clProfileGlobal.totals[clProfileGlobal.pendingType[e]];
+      t->commands++;
+      t->queued += submit - queued;
+      t->submit += start - submit;
+      t->run += end - start;
+      if(end - start > t->longestRun){
+         t->longestRun = end - start;
+      }
+   }
+   clProfileGlobal.pendingCount = 0;
+}
+
+// Event argument for the next enqueue of a command of type, NULL when
+// profiling is off
+static inline cl_event* clProfileNext(clProfileType type){
+   if(!clProfileGlobal.enabled){
+      return NULL;
+   }
+   if(clProfileGlobal.pendingCount == CL_PROFILE_MAX_PENDING){
+      clProfileCollect();
+   }
+   int slot = clProfileGlobal.pendingCount++;
+   clProfileGlobal.pendingType[slot] = type;
+   return &clProfileGlobal.pending[slot];
+}
+
+// Profiles a command whose event the caller made and keeps for itself
+static inline void clProfileAdd(clProfileType type, cl_event event){
+   cl_event* slot = clProfileNext(type);
+   if(slot){
+      clRetainEvent(event);
+      *slot = event;
+   }
+}
+
+static inline void clProfilePrint(FILE* out, const char* label, const clProfileTotals* t){
+   if(t->commands == 0){
+      return;
+   }
+   fprintf(out, "%s: %llu commands, queued %.3fms, submit %.3fms, run %.3fms "
+      "(%.3fms average", label, (unsigned long long)t->commands,
+      t->queued * 1e-6, t->submit * 1e-6, t->run * 1e-6, t->run * 1e-6 / t->commands);
+   if(t->longestRun > 0){
+      fprintf(out, ", %.3fms longest", t->longestRun * 1e-6);
+   }
+   fprintf(out, ")\n");
+}
+
+// One line per command type that ran since the previous report
+static inline void clProfileFrameReport(FILE* out, unsigned int frame){
+   if(!clProfileGlobal.enabled){
+      return;
+   }
+   clProfileCollect();
+   char label[64];
+   for(int type = 0; type < CL_PROFILE_TYPE_COUNT; ++type){
+      clProfileTotals* all = &clProfileGlobal.totals[type];
+      clProfileTotals* before = &clProfileGlobal.reported[type];
+      clProfileTotals frameTotals = {
+         .commands = all->commands - before->commands,
+         .queued = all->queued - before->queued,
+         .submit = all->submit - before->submit,
+         .run = all->run - before->run
+      };
+      *before = *all;
+      snprintf(label, sizeof(label), "OpenCL frame %u %s", frame, clProfileTypeNames[type]);
+      clProfilePrint(out, label, &frameTotals);
+   }
+}
+
+static inline void clProfileSummary(FILE* out){
+   if(!clProfileGlobal.enabled){
+      return;
+   }
+   clProfileCollect();
+   char label[64];
+   for(int type = 0; type < CL_PROFILE_TYPE_COUNT; ++type){
+      snprintf(label, sizeof(label), "OpenCL total %s", clProfileTypeNames[type]);
+      clProfilePrint(out, label, &clProfileGlobal.totals[type]);
+   }
+   if(clProfileGlobal.failed > 0){
+      fprintf(out, "OpenCL profiling: %llu events without timestamps\n",
+         (unsigned long long)clProfileGlobal.failed);
+   }
+}
+
+#endif
@@ -0,0 +1,20 @@
+// Monotonic wall clock that works without a GLUT window.
+// glutGet(GLUT_ELAPSED_TIME) needs an initialized window and only has
+// millisecond resolution, so batch runs use this instead.
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include <stdint.h>
+#include <time.h>
+
+static inline uint64_t nowNanoseconds(void){
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+static inline double nanosecondsToMilliseconds(uint64_t nanoseconds){
+   return nanoseconds / 1e6;
+}
+
+#endif
@@ -0,0 +1,254 @@
+// Per-thread frame arenas for per-frame scratch memory, and a heap
+// allocation counter for the frame loop.
+//
+// Every thread that asks for scratch gets its own arena on first use, so
+// arenaAllocate() is a pointer bump without locks and without the heap.
+// arenaResetAll() at the frame boundary releases all scratch at once.
+// Scratch used only for a part of the frame can be given back earlier
+// with arenaMark() / arenaRewind().
+//
+// A frame that needs more than its arena holds gets the rest from
+// alignedAllocate(). The arena then grows to the largest demand seen at
+// the next reset, so after the first frames the frame loop allocates
+// nothing. heapAllocationCount() counts those overflows and every large
+// buffer alignedAllocate() mapped, and with -DCOUNT_ALLOCATIONS (glibc)
+// also every malloc(), calloc(), realloc(), aligned_alloc(),
+// posix_memalign() and memalign() that the program's own code makes. Calls
+// from shared libraries are left out: libgomp frees and allocates thread
+// team memory inside every parallel region of a one thread team, which is
+// not the frame loop's doing. The counting versions are plain definitions,
+// so this header must be included from a single translation unit when the
+// flag is set.
+#ifndef FRAME_ARENA_H
+#define FRAME_ARENA_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "alloc.h"
+
+#define ARENA_MAX_THREADS 256
+#define ARENA_MAX_OVERFLOWS 64
+// Alignment of every block, so scratch arrays never share a cache line
+#define ARENA_ALIGNMENT ALLOC_CACHE_LINE
+
+typedef struct{
+   char* base;
+   size_t capacity;
+   size_t used;
+   size_t demand;                   // bytes asked for since the last reset
+   size_t highWater;
+   // Blocks that did not fit, freed at the next reset
+   void* overflow[ARENA_MAX_OVERFLOWS];
+   size_t overflowBytes[ARENA_MAX_OVERFLOWS];
+   int overflowCount;
+} frameArena;
+
+typedef struct{
+   frameArena* arenas[ARENA_MAX_THREADS];
+   int arenaCount;
+   uint64_t overflows;              // blocks that came from alignedAllocate()
+   uint64_t resets;
+} arenaState;
+
+static arenaState arenaGlobal;
+static __thread frameArena* arenaCurrent = NULL;
+
+#ifdef COUNT_ALLOCATIONS
+#include <errno.h>
+
+static uint64_t heapAllocations = 0;
+
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t count, size_t size);
+extern void* __libc_realloc(void* memory, size_t size);
+extern void* __libc_memalign(size_t alignment, size_t size);
+
+// Bounds of the executable's code, from the linker
+extern const char __executable_start[];
+extern const char etext[];
+
+// Counts the allocation if caller, the return address of the allocating
+// function, is in the executable. The allocating functions must not be
+// inlined for that, or the address would be their caller's caller.
+#define countHeapAllocation() countCallerAllocation(__builtin_return_address(0))
+
+static inline void countCallerAllocation(const void* caller){
+   if((const char*)caller >= __executable_start && (const char*)caller < etext){
+      __atomic_fetch_add(&heapAllocations, 1, __ATOMIC_RELAXED);
+   }
+}
+
+__attribute__((noinline)) void* malloc(size_t size){
+   countHeapAllocation();
+   return __libc_malloc(size);
+}
+
+__attribute__((noinline)) void* calloc(size_t count, size_t size){
+   countHeapAllocation();
+   return __libc_calloc(count, size);
+}
+
+__attribute__((noinline)) void* realloc(void* memory, size_t size){
+   countHeapAllocation();
+   return __libc_realloc(memory, size);
+}
+
+__attribute__((noinline)) void* memalign(size_t alignment, size_t size){
+   countHeapAllocation();
+   return __libc_memalign(alignment, size);
+}
+
+__attribute__((noinline)) void* aligned_alloc(size_t alignment, size_t size){
+   countHeapAllocation();
+   return __libc_memalign(alignment, size);
+}
+
+__attribute__((noinline)) int posix_memalign(void** memory, size_t alignment, size_t size){
+   if(alignment % sizeof(void*) != 0 || (alignment & (alignment - 1)) != 0){
+      return EINVAL;
+   }
+   countHeapAllocation();
+   void* block = __libc_memalign(alignment, size);
+   if(!block){
+      return ENOMEM;
+   }
+   *memory = block;
+   return 0;
+}
+#endif
+
+// Allocations the frame loop must not make once it runs steadily
+static inline uint64_t heapAllocationCount(void){
+   uint64_t count = allocGlobal.explicitHuge + allocGlobal.transparentHuge +
+      allocGlobal.smallPages + __atomic_load_n(&arenaGlobal.overflows, __ATOMIC_RELAXED);
+#ifdef COUNT_ALLOCATIONS
+   count += __atomic_load_n(&heapAllocations, __ATOMIC_RELAXED);
+#endif
+   return count;
+}
+
+// Whether heapAllocationCount() includes malloc() and friends
+static inline int heapAllocationsCounted(void){
+#ifdef COUNT_ALLOCATIONS
+   return 1;
+#else
+   return 0;
+#endif
+}
+
+// Arena of the calling thread, NULL if there are too many threads
+static inline frameArena* threadArena(void){
+   if(arenaCurrent){
+      return arenaCurrent;
+   }
+   int id = __atomic_fetch_add(&arenaGlobal.arenaCount, 1, __ATOMIC_RELAXED);
+   if(id >= ARENA_MAX_THREADS){
+      return NULL;
+   }
+   frameArena* arena = (frameArena*)alignedAllocate(sizeof(frameArena), ALLOC_CACHE_LINE);
+   if(!arena){
+      return NULL;
+   }
+   *arena = (frameArena){.base = NULL};
+   __atomic_store_n(&arenaGlobal.arenas[id], arena, __ATOMIC_RELEASE);
+   arenaCurrent = arena;
+   return arena;
+}
+
+// Scratch of bytes from the calling thread's arena, valid until the next
+// arenaResetAll() or a rewind past it. NULL if memory ran out.
+static inline void* arenaAllocate(size_t bytes){
+   frameArena* arena = threadArena();
+   size_t size = (bytes + ARENA_ALIGNMENT - 1) / ARENA_ALIGNMENT * ARENA_ALIGNMENT;
+   if(!arena){
+      return NULL;
+   }
+   arena->demand += size;
+   if(arena->demand > arena->highWater){
+      arena->highWater = arena->demand;
+   }
+   if(arena->used + size <= arena->capacity){
+      void* block = arena->base + arena->used;
+      arena->used += size;
+      return block;
+   }
+   if(arena->overflowCount == ARENA_MAX_OVERFLOWS){
+      return NULL;
+   }
+   void* block = alignedAllocate(size, ARENA_ALIGNMENT);
+   if(block){
+      arena->overflow[arena->overflowCount] = block;
+      arena->overflowBytes[arena->overflowCount++] = size;
+      __atomic_fetch_add(&arenaGlobal.overflows, 1, __ATOMIC_RELAXED);
+   }
+   return block;
+}
+
+// Position of the calling thread's arena, for arenaRewind()
+static inline size_t arenaMark(void){
+   frameArena* arena = threadArena();
+   return arena ? arena->demand : 0;
+}
+
+// Gives back the scratch allocated since mark. Blocks that overflowed stay
+// until the next reset.
+static inline void arenaRewind(size_t mark){
+   frameArena* arena = threadArena();
+   if(arena && mark <= arena->demand){
+      arena->demand = mark;
+      arena->used = mark < arena->used ? mark : arena->used;
+   }
+}
+
+// Releases the scratch of every thread. No thread may use its scratch
+// any more, so call it between frames. Arenas that overflowed grow here.
+static inline void arenaResetAll(void){
+   int count = __atomic_load_n(&arenaGlobal.arenaCount, __ATOMIC_ACQUIRE);
+   for(int a = 0; a < count && a < ARENA_MAX_THREADS; ++a){
+      frameArena* arena = __atomic_load_n(&arenaGlobal.arenas[a], __ATOMIC_ACQUIRE);
+      if(!arena){
+         continue;
+      }
+      for(int o = 0; o < arena->overflowCount; ++o){
+         alignedFree(arena->overflow[o], arena->overflowBytes[o]);
+      }
+      if(arena->highWater > arena->capacity){
+         alignedFree(arena->base, arena->capacity);
+         arena->base = (char*)alignedAllocate(arena->highWater, ARENA_ALIGNMENT);
+         arena->capacity = arena->base ? arena->highWater : 0;
+      }
+      arena->overflowCount = 0;
+      arena->used = 0;
+      arena->demand = 0;
+   }
+   arenaGlobal.resets++;
+}
+
+static inline void arenaPrintStatistics(FILE* out){
+   size_t total = 0;
+   int count = __atomic_load_n(&arenaGlobal.arenaCount, __ATOMIC_ACQUIRE);
+   for(int a = 0; a < count && a < ARENA_MAX_THREADS; ++a){
+      total += arenaGlobal.arenas[a] ? arenaGlobal.arenas[a]->capacity : 0;
+   }
+   fprintf(out, "Frame arenas: %d threads, %.1f MB, %llu overflow blocks over %llu frames\n",
+      count < ARENA_MAX_THREADS ? count : ARENA_MAX_THREADS, total / 1e6,
+      (unsigned long long)arenaGlobal.overflows, (unsigned long long)arenaGlobal.resets);
+}
+
+static inline void arenaDestroyAll(void){
+   arenaResetAll();
+   int count = __atomic_load_n(&arenaGlobal.arenaCount, __ATOMIC_ACQUIRE);
+   for(int a = 0; a < count && a < ARENA_MAX_THREADS; ++a){
+      frameArena* arena = arenaGlobal.arenas[a];
+      if(arena){
+         alignedFree(arena->base, arena->capacity);
+         arena->base = NULL;
+         arena->capacity = 0;
+         arena->highWater = 0;
+      }
+   }
+}
+
+#endif
@@ -0,0 +1,398 @@
+// Streams rendered frames to disk without stalling the frame loop.
+//
+// frameSinkPush() copies the float frame into one of a few preallocated
+// queue slots and returns. A background writer thread converts queued
+// frames to 8 bit and stores them straight into a memory mapped,
+// preallocated output file, so the render thread never waits on I/O unless
+// the queue is full.
+//
+// The output format follows the file name:
+//   name.y4m         YUV4MPEG2 stream, 4:4:4 full range BT.601
+//   name.rgb/.raw    headerless rgb24 frames
+//                    (ffmpeg -f rawvideo -pix_fmt rgb24 -s WxH -i name.rgb)
+//   name%06u.ppm     one PPM file per frame, %u or %0Nu is the frame number.
+//                    Without a %u the number is added before ".ppm", any
+//                    other % in the name is refused.
+//
+// Needs -pthread. A sink has exactly one producer thread.
+#ifndef FRAME_SINK_H
+#define FRAME_SINK_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "image_io.h"
+
+typedef enum{
+   FRAME_SINK_Y4M,
+   FRAME_SINK_RAW,
+   FRAME_SINK_PPM
+} frameSinkFormat;
+
+typedef struct{
+   frameSinkFormat format;
+   int width;
+   int height;
+   char path[4096];
+   int dropWhenFull;
+
+   // PPM file names: prefix, frame number of at least frameDigits digits, suffix
+   char framePrefix[4096];
+   char frameSuffix[4096];
+   int frameDigits;
+
+   // Mapped stream file (Y4M and raw)
+   int fd;
+   uint8_t* map;
+   size_t mapSize;
+   size_t writeOffset;
+   size_t frameBytes;
+
+   // Bounded queue of float frames waiting for the writer
+   float** slots;
+   unsigned int slotCount;
+   unsigned int head;
+   unsigned int tail;
+   unsigned int queued;
+   int closing;
+   pthread_t writer;
+   pthread_mutex_t lock;
+   pthread_cond_t notEmpty;
+   pthread_cond_t notFull;
+
+   unsigned int framesQueued;
+   unsigned int framesWritten;
+   unsigned int framesDropped;
+   int error;
+} frameSink;
+
+#define FRAME_SINK_Y4M_FRAME_HEADER "FRAME\n"
+
+// Maps [0, size) of the stream file, growing the file when needed
+static inline int frameSinkMap(frameSink* sink, size_t size){
+   if(sink->map){
+      munmap(sink->map, sink->mapSize);
+      sink->map = NULL;
+   }
+   if(ftruncate(sink->fd, size) != 0){
+      return -1;
+   }
+   // Reserve the blocks up front so that page faults in the writer do not
+   // have to allocate disk space. Not every file system supports this.
+   posix_fallocate(sink->fd, 0, size);
+   void* map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, sink->fd, 0);
+   if(map == MAP_FAILED){
+      return -1;
+   }
+   sink->map = (uint8_t*)map;
+   sink->mapSize = size;
+   return 0;
+}
+
+// Full range BT.601 RGB to YCbCr, planar 4:4:4, rows top down
+static inline void frameToYUV444(const float* rgb, int width, int height, uint8_t* out){
+   size_t plane = (size_t)width * height;
+   for(int y = 0; y < height; ++y){
+      const float* row = rgb + (size_t)(height - 1 - y) * width * 3;
+      size_t target = (size_t)y * width;
+      for(int x = 0; x < width; ++x){
+         float r = channelToByte(row[3 * x]);
+         float g = channelToByte(row[3 * x + 1]);
+         float b = channelToByte(row[3 * x + 2]);
+         float luma = 0.299f * r + 0.587f * g + 0.114f * b;
+         float cb = 128.f - 0.168736f * r - 0.331264f * g + 0.5f * b;
+         float cr = 128.f + 0.5f * r - 0.418688f * g - 0.081312f * b;
+         out[target + x] = (uint8_t)(luma + 0.5f);
+         out[plane + target + x] = (uint8_t)(cb > 255.f ? 255.f : cb + 0.5f);
+         out[2 * plane + target + x] = (uint8_t)(cr > 255.f ? 255.f : cr + 0.5f);
+      }
+   }
+}
+
+// Writes one PPM file of the sequence through its own mapping
+static inline int frameSinkWritePPM(frameSink* sink, const float* rgb, unsigned int frame){
+   char path[sizeof(sink->framePrefix) + sizeof(sink->frameSuffix) + 16];
+   char header[64];
+   snprintf(path, sizeof(path), "%s%0*u%s", sink->framePrefix, sink->frameDigits, frame,
+      sink->frameSuffix);
+   int headerLength = snprintf(header, sizeof(header), "P6\n%d %d\n255\n",
+      sink->width, sink->height);
+   size_t size = headerLength + (size_t)sink->width * sink->height * 3;
+
+   int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+   if(fd < 0){
+      return -1;
+   }
+   if(ftruncate(fd, size) != 0){
+      close(fd);
+      return -1;
+   }
+   uint8_t* map = (uint8_t*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   close(fd);
+   if(map == MAP_FAILED){
+      return -1;
+   }
+   memcpy(map, header, headerLength);
+   frameToRGB8(rgb, sink->width, sink->height, map + headerLength);
+   munmap(map, size);
+   return 0;
+}
+
+// Appends one frame to the mapped stream file
+static inline int frameSinkWriteStream(frameSink* sink, const float* rgb){
+   if(sink->writeOffset + sink->frameBytes > sink->mapSize){
+      // More frames than preallocated: double the file
+      if(frameSinkMap(sink, sink->mapSize * 2)){
+         return -1;
+      }
+   }
+   uint8_t* target = sink->map + sink->writeOffset;
+   if(sink->format == FRAME_SINK_Y4M){
+      memcpy(target, FRAME_SINK_Y4M_FRAME_HEADER, strlen(FRAME_SINK_Y4M_FRAME_HEADER));
+      frameToYUV444(rgb, sink->width, sink->height,
+         target + strlen(FRAME_SINK_Y4M_FRAME_HEADER));
+   } else {
+      frameToRGB8(rgb, sink->width, sink->height, target);
+   }
+   // Start write back now instead of letting dirty pages pile up
+   size_t page = (size_t)sysconf(_SC_PAGESIZE);
+   size_t start = sink->writeOffset / page * page;
+   msync(sink->map + start, sink->writeOffset + sink->frameBytes - start, MS_ASYNC);
+   sink->writeOffset += sink->frameBytes;
+   return 0;
+}
+
+static inline void* frameSinkWriterThread(void* argument){
+   frameSink* sink = (frameSink*)argument;
+   for(;;){
+      pthread_mutex_lock(&sink->lock);
+      while(sink->queued == 0 && !sink->closing){
+         pthread_cond_wait(&sink->notEmpty, &sink->lock);
+      }
+      if(sink->queued == 0){
+         pthread_mutex_unlock(&sink->lock);
+         return NULL;
+      }
+      const float* frame = sink->slots[sink->head];
+      unsigned int frameNumber = sink->framesWritten;
+      pthread_mutex_unlock(&sink->lock);
+
+      int failed = sink->format == FRAME_SINK_PPM ?
+         frameSinkWritePPM(sink, frame, frameNumber) :
+         frameSinkWriteStream(sink, frame);
+
+      pthread_mutex_lock(&sink->lock);
+      if(failed && !sink->error){
+         sink->error = errno ? errno : EIO;
+      }
+      sink->head = (sink->head + 1) % sink->slotCount;
+      sink->queued--;
+      sink->framesWritten++;
+      pthread_cond_signal(&sink->notFull);
+      pthread_mutex_unlock(&sink->lock);
+   }
+}
+
+// Splits a PPM sequence name around its one %u or %0Nu conversion, or
+// around ".ppm" with six digits if there is no %. Any other % is refused,
+// the name never becomes a format string.
+static inline int frameSinkSequenceName(frameSink* sink, const char* path, const char* extension){
+   const char* percent = strchr(path, '%');
+   const char* after = extension;
+   sink->frameDigits = 6;
+   if(percent){
+      after = percent + 1;
+      sink->frameDigits = 0;
+      if(*after == '0'){
+         while(*after >= '0' && *after <= '9' && sink->frameDigits < 10){
+            sink->frameDigits = sink->frameDigits * 10 + (*after++ - '0');
+         }
+      }
+      if(*after != 'u' || sink->frameDigits > 10 || strchr(after, '%')){
+         return -1;
+      }
+      ++after;
+   }
+   const char* end = percent ? percent : extension;
+   snprintf(sink->framePrefix, sizeof(sink->framePrefix), "%.*s%s", (int)(end - path), path,
+      percent ? "" : "_");
+   snprintf(sink->frameSuffix, sizeof(sink->frameSuffix), "%s", after);
+   return 0;
+}
+
+// Opens a sink for width x height frames. expectedFrames sizes the
+// preallocated file (0 if unknown) and queueDepth is the number of frames
+// that may wait for the writer. Returns NULL on failure.
+static inline frameSink* frameSinkOpen(const char* path, int width, int height,
+                                       unsigned int expectedFrames,
+                                       unsigned int queueDepth, int dropWhenFull){
+   frameSink* sink = (frameSink*)calloc(1, sizeof(frameSink));
+   if(!sink){
+      return NULL;
+   }
+   sink->width = width;
+   sink->height = height;
+   sink->dropWhenFull = dropWhenFull;
+   sink->fd = -1;
+   sink->slotCount = queueDepth > 0 ? queueDepth : 1;
+
+   size_t length = strlen(path);
+   const char* extension = strrchr(path, '.');
+   if(length + 16 >= sizeof(sink->path)){
+      free(sink);
+      return NULL;
+   }
+   if(extension && strcmp(extension, ".ppm") == 0){
+      sink->format = FRAME_SINK_PPM;
+      if(frameSinkSequenceName(sink, path, extension) != 0){
+         free(sink);
+         return NULL;
+      }
+      strcpy(sink->path, path);
+   } else {
+      sink->format = (extension && strcmp(extension, ".y4m") == 0) ?
+         FRAME_SINK_Y4M : FRAME_SINK_RAW;
+      strcpy(sink->path, path);
+   }
+
+   if(sink->format != FRAME_SINK_PPM){
+      char header[128];
+      int headerLength = 0;
+      sink->frameBytes = (size_t)width * height * 3;
+      if(sink->format == FRAME_SINK_Y4M){
+         headerLength = snprintf(header, sizeof(header),
+            "YUV4MPEG2 W%d H%d F30:1 Ip A1:1 C444 XCOLORRANGE=FULL\n", width, height);
+         sink->frameBytes += strlen(FRAME_SINK_Y4M_FRAME_HEADER);
+      }
+      sink->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+      if(sink->fd < 0 ||
+         frameSinkMap(sink, headerLength + sink->frameBytes *
+                            (expectedFrames > 0 ? expectedFrames : 64))){
+         if(sink->fd >= 0){
+            close(sink->fd);
+         }
+         free(sink);
+         return NULL;
+      }
+      memcpy(sink->map, header, headerLength);
+      sink->writeOffset = headerLength;
+   }
+
+   sink->slots = (float**)calloc(sink->slotCount, sizeof(float*));
+   for(unsigned int i = 0; sink->slots && i < sink->slotCount; ++i){
+      sink->slots[i] = (float*)malloc(sizeof(float) * 3 * width * height);
+      if(!sink->slots[i]){
+         sink->error = ENOMEM;
+      }
+   }
+   pthread_mutex_init(&sink->lock, NULL);
+   pthread_cond_init(&sink->notEmpty, NULL);
+   pthread_cond_init(&sink->notFull, NULL);
+   if(!sink->slots || sink->error ||
+      pthread_create(&sink->writer, NULL, frameSinkWriterThread, sink) != 0){
+      for(unsigned int i = 0; sink->slots && i < sink->slotCount; ++i){
+         free(sink->slots[i]);
+      }
+      free(sink->slots);
+      if(sink->map){
+         munmap(sink->map, sink->mapSize);
+         close(sink->fd);
+      }
+      free(sink);
+      return NULL;
+   }
+   return sink;
+}
+
+// Queues a copy of the frame. Returns 0 when queued, 1 when the frame was
+// dropped because the queue was full and -1 after a write error.
+static inline int frameSinkPush(frameSink* sink, const float* rgb){
+   pthread_mutex_lock(&sink->lock);
+   if(sink->error){
+      pthread_mutex_unlock(&sink->lock);
+      return -1;
+   }
+   if(sink->queued == sink->slotCount && sink->dropWhenFull){
+      sink->framesDropped++;
+      pthread_mutex_unlock(&sink->lock);
+      return 1;
+   }
+   while(sink->queued == sink->slotCount){
+      pthread_cond_wait(&sink->notFull, &sink->lock);
+   }
+   float* slot = sink->slots[sink->tail];
+   pthread_mutex_unlock(&sink->lock);
+
+   // The writer never touches slots past the queued ones
+   memcpy(slot, rgb, sizeof(float) * 3 * sink->width * sink->height);
+
+   pthread_mutex_lock(&sink->lock);
+   sink->tail = (sink->tail + 1) % sink->slotCount;
+   sink->queued++;
+   sink->framesQueued++;
+   pthread_cond_signal(&sink->notEmpty);
+   pthread_mutex_unlock(&sink->lock);
+   return 0;
+}
+
+// Makes the path of one stream of a multi-stream recording by adding
+// "_<name><id>" in front of the extension: out.y4m -> out_scene3.y4m
+static inline void frameSinkStreamPath(const char* path, const char* name,
+                                       unsigned int id, char* out, size_t size){
+   const char* extension = strrchr(path, '.');
+   if(!extension || strchr(extension, '/')){
+      extension = path + strlen(path);
+   }
+   snprintf(out, size, "%.*s_%s%u%s", (int)(extension - path), path,
+      name, id, extension);
+}
+
+// Writes out everything still queued and releases the sink.
+// Returns 0 if every frame reached the file.
+static inline int frameSinkClose(frameSink* sink){
+   if(!sink){
+      return 0;
+   }
+   pthread_mutex_lock(&sink->lock);
+   sink->closing = 1;
+   pthread_cond_signal(&sink->notEmpty);
+   pthread_mutex_unlock(&sink->lock);
+   pthread_join(sink->writer, NULL);
+
+   if(sink->map){
+      munmap(sink->map, sink->mapSize);
+      // Drop the unused preallocated tail
+      if(ftruncate(sink->fd, sink->writeOffset) != 0 && !sink->error){
+         sink->error = errno;
+      }
+      close(sink->fd);
+   }
+   if(sink->framesDropped > 0){
+      printf("Frame sink %s: dropped %u of %u frames\n", sink->path,
+         sink->framesDropped, sink->framesDropped + sink->framesQueued);
+   }
+   int error = sink->error;
+   if(error){
+      printf("Frame sink %s: write failed: %s\n", sink->path, strerror(error));
+   }
+
+   for(unsigned int i = 0; i < sink->slotCount; ++i){
+      free(sink->slots[i]);
+   }
+   free(sink->slots);
+   pthread_mutex_destroy(&sink->lock);
+   pthread_cond_destroy(&sink->notEmpty);
+   pthread_cond_destroy(&sink->notFull);
+   free(sink);
+   return error ? -1 : 0;
+}
+
+#endif
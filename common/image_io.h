@@ -0,0 +1,51 @@
+// Writes float RGB frame buffers to disk.
+// The buffers use the glDrawPixels() layout: three floats per pixel, rows
+// from the bottom of the window to the top. Image files store rows from the
+// top down, so rows are flipped on the way out.
+#ifndef IMAGE_IO_H
+#define IMAGE_IO_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+// Converts one 0.0f ... 1.0f channel to a byte, clamping out of range values
+static inline uint8_t channelToByte(float value){
+   if(!(value > 0.f)) return 0;
+   if(value >= 1.f) return 255;
+   return (uint8_t)(value * 255.f + 0.5f);
+}
+
+// Converts a whole frame to top-down 8 bit RGB
+static inline void frameToRGB8(const float* rgb, int width, int height, uint8_t* out){
+   for(int y = 0; y < height; ++y){
+      const float* row = rgb + (size_t)(height - 1 - y) * width * 3;
+      uint8_t* target = out + (size_t)y * width * 3;
+      for(int x = 0; x < width * 3; ++x){
+         target[x] = channelToByte(row[x]);
+      }
+   }
+}
+
+// Returns 0 on success
+static inline int writePPM(const char* path, const float* rgb, int width, int height){
+   FILE* file = fopen(path, "wb");
+   if(!file){
+      return -1;
+   }
+   fprintf(file, "P6\n%d %d\n255\n", width, height);
+   uint8_t row[3 * 4096];
+   int ok = 1;
+   for(int y = height - 1; y >= 0 && ok; --y){
+      const float* source = rgb + (size_t)y * width * 3;
+      for(int x = 0; x < width * 3; x += 3 * 4096){
+         int count = width * 3 - x < 3 * 4096 ? width * 3 - x : 3 * 4096;
+         for(int c = 0; c < count; ++c){
+            row[c] = channelToByte(source[x + c]);
+         }
+         ok = fwrite(row, 1, count, file) == (size_t)count;
+      }
+   }
+   return (fclose(file) == 0 && ok) ? 0 : -1;
+}
+
+#endif
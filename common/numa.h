@@ -0,0 +1,242 @@
+// NUMA placement of frame buffers and pinning of worker threads (Linux).
+//
+// Pages of a buffer land on the node of the thread that first writes them
+// (first touch), so a frame buffer filled by one thread sits on one node
+// and the threads of the other socket write it over the interconnect.
+// This module lays threads out in contiguous blocks per node,
+//    thread t of T on node t * nodes / T,
+// which matches the static row partition of the engines (thread t owns
+// pixels [t * size / T, (t + 1) * size / T)), and places every thread's
+// share of a buffer on that thread's node, either
+//   - NUMA_FIRST_TOUCH: the owning thread zeroes its own share, or
+//   - NUMA_BIND: the shares are bound with mbind() before the first touch,
+//     which also holds when threads are not pinned.
+// numaReport() asks the kernel where the pages really are (move_pages())
+// and counts the bytes every frame writes to a remote node.
+//
+// The topology comes from sysfs and the calls are raw system calls, so no
+// libnuma is needed. On a machine with one node everything is a no-op.
+#ifndef NUMA_PLACEMENT_H
+#define NUMA_PLACEMENT_H
+
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "alloc.h"
+
+#define NUMA_MAX_NODES 64
+#define NUMA_MAX_CPUS 1024
+// mbind() policy, from linux/mempolicy.h
+#define NUMA_MPOL_BIND 2
+
+typedef enum{
+   NUMA_OFF,
+   NUMA_FIRST_TOUCH,
+   NUMA_BIND
+} numaPolicy;
+
+typedef struct{
+   int nodeCount;
+   int cpuCount[NUMA_MAX_NODES];
+   short* cpus[NUMA_MAX_NODES];
+   numaPolicy policy;
+   int pin;
+} numaTopology;
+
+static numaTopology numaGlobal = {.nodeCount = 1, .policy = NUMA_FIRST_TOUCH};
+
+// Parses a sysfs cpu list like "0-3,8-11" into cpus. Returns the count.
+static inline int numaParseCpuList(const char* list, short* cpus, int capacity){
+   int count = 0;
+   while(*list && *list != '\n'){
+      char* end;
+      long first = strtol(list, &end, 10);
+      long last = first;
+      if(end == list){
+         break;
+      }
+      if(*end == '-'){
+         last = strtol(end + 1, &end, 10);
+      }
+      for(long cpu = first; cpu <= last && count < capacity; ++cpu){
+         cpus[count++] = (short)cpu;
+      }
+      list = *end == ',' ? end + 1 : end;
+   }
+   return count;
+}
+
+// Reads the nodes and their cpus. policy is "off", "first-touch" or
+// "bind". Returns 0 on success.
+static inline int numaInit(const char* policy, int pin){
+   if(!policy || strcmp(policy, "first-touch") == 0){
+      numaGlobal.policy = NUMA_FIRST_TOUCH;
+   } else if(strcmp(policy, "bind") == 0){
+      numaGlobal.policy = NUMA_BIND;
+   } else if(strcmp(policy, "off") == 0){
+      numaGlobal.policy = NUMA_OFF;
+   } else {
+      printf("Unknown --numa=%s, expected off, first-touch or bind\n", policy);
+      return -1;
+   }
+   numaGlobal.pin = pin;
+
+   int nodes = 0;
+   char path[128];
+   char list[4096];
+   for(int node = 0; node < NUMA_MAX_NODES; ++node){
+      snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+      FILE* file = fopen(path, "r");
+      if(!file){
+         continue;
+      }
+      short* cpus = (short*)malloc(sizeof(short) * NUMA_MAX_CPUS);
+      int count = cpus && fgets(list, sizeof(list), file) ?
+         numaParseCpuList(list, cpus, NUMA_MAX_CPUS) : 0;
+      fclose(file);
+      // Memory only nodes get no threads
+      if(count == 0){
+         free(cpus);
+         continue;
+      }
+      numaGlobal.cpus[nodes] = cpus;
+      numaGlobal.cpuCount[nodes] = count;
+      nodes++;
+   }
+   if(nodes == 0){
+      // No sysfs, treat the machine as one node with every cpu
+      numaGlobal.cpus[0] = (short*)malloc(sizeof(short) * NUMA_MAX_CPUS);
+      numaGlobal.cpuCount[0] = 0;
+      for(int cpu = 0; numaGlobal.cpus[0] && cpu < sysconf(_SC_NPROCESSORS_ONLN) &&
+          cpu < NUMA_MAX_CPUS; ++cpu){
+         numaGlobal.cpus[0][numaGlobal.cpuCount[0]++] = (short)cpu;
+      }
+      nodes = 1;
+   }
+   numaGlobal.nodeCount = nodes;
+   return 0;
+}
+
+// Node index (into numaGlobal) of thread of threadCount
+static inline int numaThreadNode(int thread, int threadCount){
+   return (int)((int64_t)thread * numaGlobal.nodeCount / threadCount);
+}
+
+// Real node number, as used by mbind() and move_pages()
+static inline int numaNodeNumber(int nodeIndex){
+   // sysfs nodes can have gaps, find the nodeIndex-th one again
+   char path[128];
+   for(int node = 0, found = 0; node < NUMA_MAX_NODES; ++node){
+      snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+      if(access(path, R_OK) == 0 && found++ == nodeIndex){
+         return node;
+      }
+   }
+   return nodeIndex;
+}
+
+// Pins the calling thread to a cpu of its node, threads of a node spread
+// over its cpus in order. Returns the cpu, or -1 if not pinned.
+static inline int numaPinThread(int thread, int threadCount){
+   if(!numaGlobal.pin || threadCount < 1){
+      return -1;
+   }
+   int node = numaThreadNode(thread, threadCount);
+   int firstThread = (int)(((int64_t)node * threadCount + numaGlobal.nodeCount - 1) /
+      numaGlobal.nodeCount);
+   if(numaGlobal.cpuCount[node] == 0){
+      return -1;
+   }
+   int cpu = numaGlobal.cpus[node][(thread - firstThread) % numaGlobal.cpuCount[node]];
+   cpu_set_t set;
+   CPU_ZERO(&set);
+   CPU_SET(cpu, &set);
+   return sched_setaffinity(0, sizeof(set), &set) == 0 ? cpu : -1;
+}
+
+// Byte range of thread's share of a buffer of elements, rounded to the
+// (possibly huge) pages backing it
+static inline void numaShare(size_t elements, size_t elementSize, int thread,
+                             int threadCount, size_t* begin, size_t* end){
+   size_t page = allocGranularity(elements * elementSize);
+   size_t first = elements * thread / threadCount * elementSize;
+   size_t last = elements * (thread + 1) / threadCount * elementSize;
+   *begin = first / page * page;
+   *end = thread == threadCount - 1 ? elements * elementSize : last / page * page;
+}
+
+// Binds (NUMA_BIND) and zeroes every thread's share of a large, still
+// untouched buffer from alignedAllocate(). Must be called inside a
+// parallel region by all threadCount threads, thread being the caller's
+// number.
+static inline void numaPlaceShare(void* buffer, size_t elements, size_t elementSize,
+                                  int thread, int threadCount){
+   size_t begin, end;
+   numaShare(elements, elementSize, thread, threadCount, &begin, &end);
+   if(end <= begin || numaGlobal.policy == NUMA_OFF){
+      return;
+   }
+   if(numaGlobal.policy == NUMA_BIND && numaGlobal.nodeCount > 1){
+      unsigned long mask[NUMA_MAX_NODES / (8 * sizeof(unsigned long)) + 1] = {0};
+      int node = numaNodeNumber(numaThreadNode(thread, threadCount));
+      mask[node / (8 * sizeof(unsigned long))] |= 1ul << (node % (8 * sizeof(unsigned long)));
+      if(syscall(SYS_mbind, (char*)buffer + begin, end - begin, NUMA_MPOL_BIND,
+                 mask, NUMA_MAX_NODES + 1, 0)){
+         perror("mbind");
+      }
+   }
+   memset((char*)buffer + begin, 0, end - begin);
+}
+
+// Prints where the pages of every thread's share are and how many bytes
+// a full frame write sends to a remote node
+static inline void numaReport(const void* buffer, size_t elements, size_t elementSize,
+                              int threadCount, const char* label){
+   size_t page = (size_t)sysconf(_SC_PAGESIZE);
+   size_t remoteBytes = 0, totalBytes = 0;
+   printf("%s: %d nodes, %d threads, policy %s%s\n", label, numaGlobal.nodeCount,
+      threadCount, numaGlobal.policy == NUMA_BIND ? "bind" :
+      numaGlobal.policy == NUMA_FIRST_TOUCH ? "first-touch" : "off",
+      numaGlobal.pin ? ", pinned" : "");
+   for(int t = 0; t < threadCount; ++t){
+      size_t begin, end;
+      numaShare(elements, elementSize, t, threadCount, &begin, &end);
+      unsigned long count = end > begin ? (end - begin + page - 1) / page : 0;
+      void** pages = (void**)malloc(sizeof(void*) * (count + 1));
+      int* status = (int*)malloc(sizeof(int) * (count + 1));
+      if(!pages || !status){
+         free(pages);
+         free(status);
+         return;
+      }
+      for(unsigned long p = 0; p < count; ++p){
+         pages[p] = (char*)buffer + begin + p * page;
+      }
+      int home = numaNodeNumber(numaThreadNode(t, threadCount));
+      unsigned long local = 0, remote = 0, unknown = 0;
+      if(count > 0 && syscall(SYS_move_pages, 0, count, pages, NULL, status, 0) == 0){
+         for(unsigned long p = 0; p < count; ++p){
+            if(status[p] < 0) unknown++;
+            else if(status[p] == home) local++;
+            else remote++;
+         }
+      } else {
+         unknown = count;
+      }
+      printf("  thread %d (node %d): %lu pages local, %lu remote, %lu unknown\n",
+         t, home, local, remote, unknown);
+      remoteBytes += remote * page;
+      totalBytes += end - begin;
+      free(pages);
+      free(status);
+   }
+   printf("  %.2f of %.2f MB written per frame cross a node boundary\n",
+      remoteBytes / 1e6, totalBytes / 1e6);
+}
+
+#endif
@@ -0,0 +1,53 @@
+// Small command line helpers shared by the exercise programs.
+// Options are always given as "--name=value" or as plain "--name" flags so
+// that they never get mixed up with the positional seed argument or with
+// the X11 options that glutInit() consumes.
+#ifndef OPTIONS_H
+#define OPTIONS_H
+
+#include <stdlib.h>
+#include <string.h>
+
+// Returns the text after "--name=" or NULL if the option was not given
+static inline const char* optionValue(int argc, char** argv, const char* name){
+   size_t length = strlen(name);
+   for(int i = 1; i < argc; ++i){
+      if(strncmp(argv[i], "--", 2) == 0 &&
+         strncmp(argv[i] + 2, name, length) == 0 &&
+         argv[i][2 + length] == '='){
+         return argv[i] + 3 + length;
+      }
+   }
+   return NULL;
+}
+
+// Returns 1 if "--name" or "--name=..." was given
+static inline int optionFlag(int argc, char** argv, const char* name){
+   size_t length = strlen(name);
+   for(int i = 1; i < argc; ++i){
+      if(strncmp(argv[i], "--", 2) == 0 &&
+         strncmp(argv[i] + 2, name, length) == 0 &&
+         (argv[i][2 + length] == '\0' || argv[i][2 + length] == '=')){
+         return 1;
+      }
+   }
+   return 0;
+}
+
+// Integer option with a default value
+static inline long optionLong(int argc, char** argv, const char* name, long fallback){
+   const char* value = optionValue(argc, argv, name);
+   return value ? strtol(value, NULL, 0) : fallback;
+}
+
+// First argument that is not an option, or NULL
+static inline const char* positionalArgument(int argc, char** argv){
+   for(int i = 1; i < argc; ++i){
+      if(argv[i][0] != '-'){
+         return argv[i];
+      }
+   }
+   return NULL;
+}
+
+#endif
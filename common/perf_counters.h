@@ -0,0 +1,246 @@
+// Optional hardware performance counters through Linux perf_event_open.
+//
+// Counters are opened per thread (the first time a thread enters a traced
+// span) and read at the start and end of every span of common/trace.h, so
+// the counts are split by engine phase and by thread. Only user space is
+// counted, which works with the default perf_event_paranoid setting of 2.
+//
+// FP operations have no portable generic event. They are given as raw
+// event codes with an optional weight (operations per event), e.g. on
+// Intel Skylake and later, single precision scalar, 128 bit and 256 bit:
+//    --perf-fp=0x02c7:1,0x08c7:4,0x20c7:8
+// Counters the kernel cannot schedule all at once are multiplexed and the
+// counts are scaled by enabled / running time.
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+typedef enum{
+   PERF_CYCLES,
+   PERF_INSTRUCTIONS,
+   PERF_BRANCHES,
+   PERF_BRANCH_MISSES,
+   PERF_L1D_MISSES,
+   PERF_LLC_MISSES,
+   PERF_GENERIC_COUNT
+} perfGenericEvent;
+
+#define PERF_MAX_FP_EVENTS 4
+#define PERF_MAX_EVENTS (PERF_GENERIC_COUNT + PERF_MAX_FP_EVENTS)
+
+typedef struct{
+   int fd[PERF_MAX_EVENTS];
+   double begin[TRACE_PHASE_COUNT][PERF_MAX_EVENTS];
+   double total[TRACE_PHASE_COUNT][PERF_MAX_EVENTS];
+} perfThread;
+
+typedef struct{
+   int enabled;
+   int eventCount;
+   uint64_t fpConfig[PERF_MAX_FP_EVENTS];
+   double fpWeight[PERF_MAX_FP_EVENTS];
+   int fpCount;
+   perfThread* threads[TRACE_MAX_THREADS];
+   // Totals at the previous perfFrameReport(), for per frame deltas
+   double reported[TRACE_PHASE_COUNT][PERF_MAX_EVENTS];
+} perfState;
+
+static perfState perfGlobal;
+
+static inline int perfOpen(uint32_t type, uint64_t config){
+   struct perf_event_attr attr;
+   memset(&attr, 0, sizeof(attr));
+   attr.size = sizeof(attr);
+   attr.type = type;
+   attr.config = config;
+   attr.exclude_kernel = 1;
+   attr.exclude_hv = 1;
+   attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+   // pid 0, cpu -1: the calling thread on any cpu
+   return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+// Scaled count of one counter, 0 if it is not open
+static inline double perfRead(int fd){
+   uint64_t value[3];
+   if(fd < 0 || read(fd, value, sizeof(value)) != sizeof(value) || value[2] == 0){
+      return 0.0;
+   }
+   return (double)value[0] * ((double)value[1] / (double)value[2]);
+}
+
+static inline perfThread* perfCurrentThread(void){
+   if(traceThreadId < 0 || traceThreadId >= TRACE_MAX_THREADS){
+      return NULL;
+   }
+   perfThread* thread = perfGlobal.threads[traceThreadId];
+   if(thread){
+      return thread;
+   }
+   thread = (perfThread*)calloc(1, sizeof(perfThread));
+   if(!thread){
+      return NULL;
+   }
+   const uint64_t l1dReadMiss = PERF_COUNT_HW_CACHE_L1D |
+      (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+   thread->fd[PERF_CYCLES] = perfOpen(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+   thread->fd[PERF_INSTRUCTIONS] = perfOpen(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+   thread->fd[PERF_BRANCHES] = perfOpen(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS);
+   thread->fd[PERF_BRANCH_MISSES] = perfOpen(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+   thread->fd[PERF_L1D_MISSES] = perfOpen(PERF_TYPE_HW_CACHE, l1dReadMiss);
+   thread->fd[PERF_LLC_MISSES] = perfOpen(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+   for(int f = 0; f < perfGlobal.fpCount; ++f){
+      thread->fd[PERF_GENERIC_COUNT + f] = perfOpen(PERF_TYPE_RAW, perfGlobal.fpConfig[f]);
+   }
+   perfGlobal.threads[traceThreadId] = thread;
+   return thread;
+}
+
+static inline void perfSpanBegin(int phase){
+   perfThread* thread = perfCurrentThread();
+   if(!thread){
+      return;
+   }
+   for(int e = 0; e < perfGlobal.eventCount; ++e){
+      thread->begin[phase][e] = perfRead(thread->fd[e]);
+   }
+}
+
+static inline void perfSpanEnd(int phase){
+   perfThread* thread = perfCurrentThread();
+   if(!thread){
+      return;
+   }
+   for(int e = 0; e < perfGlobal.eventCount; ++e){
+      thread->total[phase][e] += perfRead(thread->fd[e]) - thread->begin[phase][e];
+   }
+}
+
+// Parses "config[:weight],..." raw FP events. Returns 0 on success.
+static inline int perfParseFP(const char* spec){
+   while(spec && *spec && perfGlobal.fpCount < PERF_MAX_FP_EVENTS){
+      char* end;
+      perfGlobal.fpConfig[perfGlobal.fpCount] = strtoull(spec, &end, 0);
+      perfGlobal.fpWeight[perfGlobal.fpCount] = 1.0;
+      if(end == spec){
+         return -1;
+      }
+      if(*end == ':'){
+         perfGlobal.fpWeight[perfGlobal.fpCount] = strtod(end + 1, &end);
+      }
+      perfGlobal.fpCount++;
+      spec = *end == ',' ? end + 1 : end;
+   }
+   return spec && *spec ? -1 : 0;
+}
+
+// Enables the counters. They are read at the trace span boundaries, so this
+// turns tracing on as well. Returns 0 if the counters can be opened here.
+static inline int perfInit(const char* fpSpec){
+   if(fpSpec && perfParseFP(fpSpec)){
+      printf("Bad --perf-fp list %s, expected config[:weight],...\n", fpSpec);
+      return -1;
+   }
+   int probe = perfOpen(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+   if(probe < 0){
+      printf("Hardware counters are not available (perf_event_open failed), "
+         "check /proc/sys/kernel/perf_event_paranoid\n");
+      return -1;
+   }
+   close(probe);
+   perfGlobal.enabled = 1;
+   perfGlobal.eventCount = PERF_GENERIC_COUNT + perfGlobal.fpCount;
+   if(!traceGlobal.enabled){
+      traceInit(0);
+   }
+   traceGlobal.spanBegin = perfSpanBegin;
+   traceGlobal.spanEnd = perfSpanEnd;
+   return 0;
+}
+
+// Sums a phase over all threads, either all time or since the last report
+static inline void perfPhaseTotals(int phase, double* out, int sinceReport){
+   for(int e = 0; e < PERF_MAX_EVENTS; ++e){
+      out[e] = 0.0;
+      for(int t = 0; t < TRACE_MAX_THREADS; ++t){
+         out[e] += perfGlobal.threads[t] ? perfGlobal.threads[t]->total[phase][e] : 0.0;
+      }
+      if(sinceReport){
+         double all = out[e];
+         out[e] -= perfGlobal.reported[phase][e];
+         perfGlobal.reported[phase][e] = all;
+      }
+   }
+}
+
+// IPC, misses per thousand instructions, branch miss rate and FLOP/cycle
+static inline void perfPrintMetrics(FILE* out, const char* label, const double* c){
+   if(c[PERF_CYCLES] <= 0.0){
+      return;
+   }
+   double kiloInstructions = c[PERF_INSTRUCTIONS] / 1000.0;
+   fprintf(out, "%s: %.3g cycles, IPC %.2f, L1D MPKI %.2f, LLC MPKI %.3f, "
+      "branch misses %.2f%% (%.2f MPKI)",
+      label, c[PERF_CYCLES], c[PERF_INSTRUCTIONS] / c[PERF_CYCLES],
+      kiloInstructions > 0 ? c[PERF_L1D_MISSES] / kiloInstructions : 0.0,
+      kiloInstructions > 0 ? c[PERF_LLC_MISSES] / kiloInstructions : 0.0,
+      c[PERF_BRANCHES] > 0 ? 100.0 * c[PERF_BRANCH_MISSES] / c[PERF_BRANCHES] : 0.0,
+      kiloInstructions > 0 ? c[PERF_BRANCH_MISSES] / kiloInstructions : 0.0);
+   if(perfGlobal.fpCount > 0){
+      double flops = 0.0;
+      for(int f = 0; f < perfGlobal.fpCount; ++f){
+         flops += c[PERF_GENERIC_COUNT + f] * perfGlobal.fpWeight[f];
+      }
+      fprintf(out, ", %.3g FLOP, %.2f FLOP/cycle", flops, flops / c[PERF_CYCLES]);
+   }
+   fprintf(out, "\n");
+}
+
+// One line per phase that ran since the previous report
+static inline void perfFrameReport(FILE* out, unsigned int frame){
+   if(!perfGlobal.enabled){
+      return;
+   }
+   char label[64];
+   double counts[PERF_MAX_EVENTS];
+   for(int p = 0; p < TRACE_PHASE_COUNT; ++p){
+      perfPhaseTotals(p, counts, 1);
+      snprintf(label, sizeof(label), "Counters frame %u %s", frame, tracePhaseNames[p]);
+      perfPrintMetrics(out, label, counts);
+   }
+}
+
+// All time totals per phase, and per thread for the per-thread phases
+static inline void perfSummary(FILE* out){
+   if(!perfGlobal.enabled){
+      return;
+   }
+   char label[64];
+   double counts[PERF_MAX_EVENTS];
+   for(int p = 0; p < TRACE_PHASE_COUNT; ++p){
+      perfPhaseTotals(p, counts, 0);
+      snprintf(label, sizeof(label), "Counters total %s", tracePhaseNames[p]);
+      perfPrintMetrics(out, label, counts);
+      if(p != TRACE_PHYSICS_THREAD && p != TRACE_COLORING_THREAD){
+         continue;
+      }
+      for(int t = 0; t < TRACE_MAX_THREADS; ++t){
+         if(perfGlobal.threads[t]){
+            snprintf(label, sizeof(label), "  thread %d", t);
+            perfPrintMetrics(out, label, perfGlobal.threads[t]->total[p]);
+         }
+      }
+   }
+}
+
+#endif
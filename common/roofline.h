@@ -0,0 +1,267 @@
+// Roofline report: whether an engine phase is compute bound or bandwidth
+// bound on this host.
+//
+// The engines describe every phase they ran with rooflineAddKernel():
+// FLOPs and bytes of one span of the phase, counted from their loop
+// structure, and the measured time per span (common/trace.h, or device
+// profiling). FLOPs counted by raw FP events (--perf-fp) are shown next to
+// the analytic ones when the phase had them. rooflineReport() then measures
+// the host
+//   - peak FP throughput: independent multiply-add chains on every OpenMP
+//     thread, in vectors of the widest unit the build targets. They are
+//     contracted to FMA only when the build allows it (-ffast-math or
+//     -ffp-contract=fast), like the engines, so the peak is the one this
+//     build can reach
+//   - bandwidth: a STREAM triad over arrays far larger than the caches,
+//     counting the bytes read and written (no write allocate traffic)
+// and prints per phase its arithmetic intensity (FLOP/byte), the reached
+// GFLOP/s, the roof min(peak, intensity x bandwidth) and the share of it
+// reached, and as a table to a CSV file. A phase with intensity below the
+// ridge point peak / bandwidth is bandwidth bound: fewer bytes help it,
+// fewer FLOPs do not. Above the ridge it is the other way around.
+//
+// Peaks are measured at exit, so they do not disturb the timed frames.
+// Kernels that ran on a device other than the host CPU are reported
+// without host roofs.
+#ifndef ROOFLINE_H
+#define ROOFLINE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "alloc.h"
+#include "clock.h"
+#include "perf_counters.h"
+
+#define ROOFLINE_MAX_KERNELS 8
+// Independent vector chains per thread, enough to cover the FMA latency
+// times the FMA ports of current cores
+#define ROOFLINE_CHAINS 12
+#define ROOFLINE_FMA_ITERATIONS (1 << 21)
+// Floats per triad array, 32 MB each
+#define ROOFLINE_STREAM_ELEMENTS (1 << 23)
+#define ROOFLINE_REPEAT 5
+
+#if defined(__AVX512F__)
+#define ROOFLINE_VECTOR_BYTES 64
+#elif defined(__AVX__)
+#define ROOFLINE_VECTOR_BYTES 32
+#else
+#define ROOFLINE_VECTOR_BYTES 16
+#endif
+
+typedef float rooflineFloats __attribute__((vector_size(ROOFLINE_VECTOR_BYTES)));
+typedef double rooflineDoubles __attribute__((vector_size(ROOFLINE_VECTOR_BYTES)));
+
+typedef struct{
+   const char* engine;              // "physics", "coloring"
+   char variant[64];
+   char device[64];
+   int onHost;                      // ran on the host CPU, so its roofs apply
+   int doublePrecision;
+   uint64_t spans;
+   double flops;                    // per span
+   double bytes;                    // per span
+   double seconds;                  // per span
+   double countedFlops;             // per span from FP events, 0 if none
+} rooflineKernel;
+
+typedef struct{
+   int enabled;
+   const char* csvPath;             // NULL prints the report only
+   rooflineKernel kernels[ROOFLINE_MAX_KERNELS];
+   int kernelCount;
+} rooflineState;
+
+static rooflineState rooflineGlobal;
+static volatile double rooflineSink;
+
+// Turns the report on. The phase timers of common/trace.h are needed for
+// the times, so they are enabled too.
+static inline void rooflineInit(const char* csvPath){
+   rooflineGlobal.enabled = 1;
+   rooflineGlobal.csvPath = csvPath;
+   if(!traceGlobal.enabled){
+      traceInit(0);
+   }
+}
+
+// Spans of phase over all threads and their average seconds
+static inline uint64_t rooflinePhaseTime(int phase, double* seconds){
+   uint64_t count = 0, total = 0;
+   for(int t = 0; t < TRACE_MAX_THREADS; ++t){
+      if(traceGlobal.threads[t]){
+         count += traceGlobal.threads[t]->count[phase];
+         total += traceGlobal.threads[t]->total[phase];
+      }
+   }
+   *seconds = count > 0 ? total * 1e-9 / count : 0.0;
+   return count;
+}
+
+// FLOPs of phase from the raw FP events, weighted, 0 without them
+static inline double rooflineCountedFlops(int phase){
+   if(!perfGlobal.enabled || perfGlobal.fpCount == 0){
+      return 0.0;
+   }
+   double counts[PERF_MAX_EVENTS];
+   perfPhaseTotals(phase, counts, 0);
+   double flops = 0.0;
+   for(int f = 0; f < perfGlobal.fpCount; ++f){
+      flops += counts[PERF_GENERIC_COUNT + f] * perfGlobal.fpWeight[f];
+   }
+   return flops;
+}
+
+static inline void rooflineAddKernel(const rooflineKernel* kernel){
+   if(rooflineGlobal.kernelCount < ROOFLINE_MAX_KERNELS && kernel->spans > 0){
+      rooflineGlobal.kernels[rooflineGlobal.kernelCount++] = *kernel;
+   }
+}
+
+static inline int rooflineThreads(void){
+#ifdef _OPENMP
+   return omp_get_max_threads();
+#else
+   return 1;
+#endif
+}
+
+// GFLOP/s of ROOFLINE_CHAINS multiply-add chains per thread on all threads
+#define ROOFLINE_PEAK(function, vector, scalar) \
+   static inline double function(void){ \
+      const int lanes = ROOFLINE_VECTOR_BYTES / sizeof(scalar); \
+      double best = 0.0; \
+      for(int r = 0; r < ROOFLINE_REPEAT; ++r){ \
+         uint64_t start = nowNanoseconds(); \
+         _Pragma("omp parallel") \
+         { \
+            vector chains[ROOFLINE_CHAINS]; \
+            vector m, a; \
+            for(int l = 0; l < lanes; ++l){ \
+               m[l] = (scalar)0.999999; \
+               a[l] = (scalar)1e-7; \
+            } \
+            for(int c = 0; c < ROOFLINE_CHAINS; ++c){ \
+               for(int l = 0; l < lanes; ++l){ \
+                  chains[c][l] = (scalar)(c * lanes + l) * (scalar)1e-3; \
+               } \
+            } \
+            for(long i = 0; i < ROOFLINE_FMA_ITERATIONS; ++i){ \
+               _Pragma("GCC unroll 16") \
+               for(int c = 0; c < ROOFLINE_CHAINS; ++c){ \
+                  chains[c] = chains[c] * m + a; \
+               } \
+            } \
+            scalar sum = 0; \
+            for(int c = 0; c < ROOFLINE_CHAINS; ++c){ \
+               for(int l = 0; l < lanes; ++l){ \
+                  sum += chains[c][l]; \
+               } \
+            } \
+            rooflineSink += sum; \
+         } \
+         double seconds = (nowNanoseconds() - start) * 1e-9; \
+         double flops = 2.0 * lanes * ROOFLINE_CHAINS * (double)ROOFLINE_FMA_ITERATIONS * \
+            rooflineThreads(); \
+         best = flops / seconds * 1e-9 > best ? flops / seconds * 1e-9 : best; \
+      } \
+      return best; \
+   }
+
+ROOFLINE_PEAK(rooflinePeakFloat, rooflineFloats, float)
+ROOFLINE_PEAK(rooflinePeakDouble, rooflineDoubles, double)
+
+// GB/s of a STREAM triad on all threads, 0 if the arrays do not fit
+static inline double rooflineBandwidth(void){
+   const long n = ROOFLINE_STREAM_ELEMENTS;
+   size_t bytes = sizeof(float) * (size_t)n;
+   float* a = (float*)alignedAllocate(bytes, ALLOC_PAGE);
+   float* b = (float*)alignedAllocate(bytes, ALLOC_PAGE);
+   float* c = (float*)alignedAllocate(bytes, ALLOC_PAGE);
+   double best = 0.0;
+   if(a && b && c){
+      // Same static split as the triad, so each thread's pages are local
+#pragma omp parallel for schedule(static)
+      for(long i = 0; i < n; ++i){
+         a[i] = 0.0f;
+         b[i] = 1.0f;
+         c[i] = 2.0f;
+      }
+      for(int r = 0; r < ROOFLINE_REPEAT; ++r){
+         uint64_t start = nowNanoseconds();
+#pragma omp parallel for schedule(static)
+         for(long i = 0; i < n; ++i){
+            a[i] = b[i] + 3.0f * c[i];
+         }
+         double gigabytes = 3.0 * bytes * 1e-9;
+         double seconds = (nowNanoseconds() - start) * 1e-9;
+         best = gigabytes / seconds > best ? gigabytes / seconds : best;
+      }
+      rooflineSink += a[n / 2];
+   }
+   alignedFree(a, bytes);
+   alignedFree(b, bytes);
+   alignedFree(c, bytes);
+   return best;
+}
+
+// Measures the host and prints every added kernel against its roofs
+static inline void rooflineReport(FILE* out){
+   if(!rooflineGlobal.enabled || rooflineGlobal.kernelCount == 0){
+      return;
+   }
+   double peaks[2] = {rooflinePeakFloat(), rooflinePeakDouble()};
+   double bandwidth = rooflineBandwidth();
+   fprintf(out, "Roofline of this host (%d threads): %.1f GFLOP/s float, %.1f GFLOP/s double, "
+      "%.1f GB/s triad, ridge at %.2f / %.2f FLOP/byte\n", rooflineThreads(), peaks[0], peaks[1],
+      bandwidth, bandwidth > 0 ? peaks[0] / bandwidth : 0.0,
+      bandwidth > 0 ? peaks[1] / bandwidth : 0.0);
+
+   FILE* csv = rooflineGlobal.csvPath ? fopen(rooflineGlobal.csvPath, "w") : NULL;
+   if(rooflineGlobal.csvPath && !csv){
+      fprintf(out, "Could not write %s\n", rooflineGlobal.csvPath);
+   }
+   if(csv){
+      fprintf(csv, "engine,variant,device,precision,spans,flops,bytes,intensity,seconds,gflops,"
+         "counted_flops,roof_gflops,share_of_roof,bound\n");
+   }
+   for(int k = 0; k < rooflineGlobal.kernelCount; ++k){
+      const rooflineKernel* r = &rooflineGlobal.kernels[k];
+      double peak = peaks[r->doublePrecision];
+      double intensity = r->bytes > 0 ? r->flops / r->bytes : 0.0;
+      double gflops = r->seconds > 0 ? r->flops / r->seconds * 1e-9 : 0.0;
+      double roof = intensity * bandwidth < peak ? intensity * bandwidth : peak;
+      const char* bound = !r->onHost ? "-" : intensity * bandwidth < peak ? "bandwidth" : "compute";
+      fprintf(out, "  %s %s on %s (%s): %.3g FLOP, %.3g bytes, %.2f FLOP/byte, %.3f ms, "
+         "%.2f GFLOP/s", r->engine, r->variant, r->device,
+         r->doublePrecision ? "double" : "float", r->flops, r->bytes, intensity,
+         r->seconds * 1e3, gflops);
+      if(r->countedFlops > 0){
+         fprintf(out, " (%.3g FLOP counted)", r->countedFlops);
+      }
+      if(r->onHost){
+         fprintf(out, ", roof %.2f GFLOP/s, %.1f%% of it, %s bound\n", roof,
+            roof > 0 ? 100.0 * gflops / roof : 0.0, bound);
+      } else {
+         fprintf(out, ", not on the host, no roof\n");
+      }
+      if(csv){
+         fprintf(csv, "%s,%s,\"%s\",%s,%llu,%.6g,%.6g,%.6g,%.6g,%.6g,%.6g,%.6g,%.6g,%s\n",
+            r->engine, r->variant, r->device, r->doublePrecision ? "double" : "float",
+            (unsigned long long)r->spans, r->flops, r->bytes, intensity, r->seconds, gflops,
+            r->countedFlops, r->onHost ? roof : 0.0,
+            r->onHost && roof > 0 ? gflops / roof : 0.0, bound);
+      }
+   }
+   if(csv){
+      fclose(csv);
+      fprintf(out, "Roofline written to %s\n", rooflineGlobal.csvPath);
+   }
+}
+
+#endif
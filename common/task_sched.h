@@ -0,0 +1,293 @@
+// Work-stealing task scheduler with persistent worker threads.
+//
+// schedParallelFor() runs body(context, begin, end) over [0, count) in
+// tasks of at most grain items. Every worker owns a Chase-Lev deque
+// (Chase & Lev 2005, with the C11 orderings of Le et al. 2013):
+//   - the range is first cut into one contiguous share per worker, so an
+//     evenly loaded job runs like schedule(static) without any stealing
+//   - a worker takes a range from the bottom of its own deque, pushes the
+//     upper half back until at most grain items are left and runs those
+//   - a worker with an empty deque steals from the top of a random
+//     victim, which is always the largest range that victim still has.
+// So expensive regions get split and spread, cheap ones run in one piece.
+//
+// Workers are created once and kept between jobs. After a job they spin
+// for SCHED_SPIN_NANOSECONDS, so back to back jobs (physics, then coloring)
+// do not go through the kernel, and then sleep on a condition variable.
+// The calling thread works as worker 0.
+#ifndef TASK_SCHED_H
+#define TASK_SCHED_H
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "clock.h"
+#include "trace.h"
+
+// Ranges pending in one deque, splitting keeps this at about log2(count)
+#define SCHED_DEQUE_SIZE 256
+#define SCHED_SPIN_NANOSECONDS 200000
+
+typedef void (*schedRangeFunction)(void* context, int begin, int end);
+// Called once on every worker before its first job, e.g. to pin it
+typedef void (*schedWorkerStartFunction)(int worker, int workerCount);
+
+// A range packed in one word, so it is read and written atomically
+typedef uint64_t schedRange;
+
+static inline schedRange schedMakeRange(int begin, int end){
+   return ((uint64_t)(uint32_t)begin << 32) | (uint32_t)end;
+}
+
+typedef struct{
+   int64_t top;                     // thieves take from here
+   char pad[56];
+   int64_t bottom;                  // the owner pushes and pops here
+   schedRange items[SCHED_DEQUE_SIZE];
+} __attribute__((aligned(64))) schedDeque;
+
+struct taskScheduler;
+
+typedef struct{
+   schedDeque deque;
+   struct taskScheduler* scheduler;
+   int id;
+   uint32_t random;
+   pthread_t thread;
+   // Statistics, written by this worker only
+   uint64_t tasks;
+   uint64_t steals;
+} __attribute__((aligned(64))) schedWorker;
+
+typedef struct taskScheduler{
+   int workerCount;
+   schedWorker* workers;
+
+   // The current job, written before generation is bumped
+   schedRangeFunction body;
+   void* context;
+   int grain;
+   int tracePhase;                  // per worker span, -1 for none
+   int64_t remaining;               // items not yet run
+   int finished;                    // workers other than 0 done with the job
+   unsigned int generation;
+   int quit;
+   schedWorkerStartFunction workerStart;
+
+   pthread_mutex_t lock;
+   pthread_cond_t wake;
+   int sleepers;
+} taskScheduler;
+
+static inline void schedPush(schedDeque* d, schedRange range){
+   int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+   __atomic_store_n(&d->items[b & (SCHED_DEQUE_SIZE - 1)], range, __ATOMIC_RELAXED);
+   __atomic_thread_fence(__ATOMIC_RELEASE);
+   __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+}
+
+// Owner side. Returns 0 when the deque is empty.
+static inline int schedPop(schedDeque* d, schedRange* range){
+   int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+   __atomic_store_n(&d->bottom, b, __ATOMIC_RELAXED);
+   __atomic_thread_fence(__ATOMIC_SEQ_CST);
+   int64_t t = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+   if(t > b){
+      __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+      return 0;
+   }
+   *range = __atomic_load_n(&d->items[b & (SCHED_DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+   if(t == b){
+      // Last item, race against thieves for it
+      int won = __atomic_compare_exchange_n(&d->top, &t, t + 1, 0,
+         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+      __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+      return won;
+   }
+   return 1;
+}
+
+// Thief side. Returns 0 when empty or when another thread won the item.
+static inline int schedSteal(schedDeque* d, schedRange* range){
+   int64_t t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+   __atomic_thread_fence(__ATOMIC_SEQ_CST);
+   int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+   if(t >= b){
+      return 0;
+   }
+   *range = __atomic_load_n(&d->items[t & (SCHED_DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+   return __atomic_compare_exchange_n(&d->top, &t, t + 1, 0,
+      __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+// Splits, runs and steals until every item of the current job has run
+static inline void schedRunJob(schedWorker* worker){
+   taskScheduler* s = worker->scheduler;
+   traceScope span = {.phase = s->tracePhase};
+   if(s->tracePhase >= 0){
+      span = traceScopeBegin(s->tracePhase);
+   }
+   schedRange range;
+   while(__atomic_load_n(&s->remaining, __ATOMIC_ACQUIRE) > 0){
+      int found = schedPop(&worker->deque, &range);
+      for(int attempt = 0; !found && attempt < 2 * s->workerCount; ++attempt){
+         worker->random ^= worker->random << 13;
+         worker->random ^= worker->random >> 17;
+         worker->random ^= worker->random << 5;
+         int victim = worker->random % s->workerCount;
+         if(victim != worker->id){
+            found = schedSteal(&s->workers[victim].deque, &range);
+            worker->steals += found;
+         }
+      }
+      if(!found){
+         sched_yield();
+         continue;
+      }
+      int begin = (int)(range >> 32);
+      int end = (int)(uint32_t)range;
+      while(end - begin > s->grain){
+         int middle = begin + (end - begin) / 2;
+         schedPush(&worker->deque, schedMakeRange(middle, end));
+         end = middle;
+      }
+      s->body(s->context, begin, end);
+      worker->tasks++;
+      __atomic_fetch_sub(&s->remaining, end - begin, __ATOMIC_RELEASE);
+   }
+   if(s->tracePhase >= 0){
+      traceScopeEnd(&span);
+   }
+}
+
+static inline void* schedWorkerMain(void* argument){
+   schedWorker* worker = (schedWorker*)argument;
+   taskScheduler* s = worker->scheduler;
+   unsigned int seen = 0;
+   if(s->workerStart){
+      s->workerStart(worker->id, s->workerCount);
+   }
+   for(;;){
+      // Spin for a while, then sleep until the next job
+      uint64_t spinUntil = nowNanoseconds() + SCHED_SPIN_NANOSECONDS;
+      while(__atomic_load_n(&s->generation, __ATOMIC_ACQUIRE) == seen &&
+            nowNanoseconds() < spinUntil){
+         sched_yield();
+      }
+      if(__atomic_load_n(&s->generation, __ATOMIC_ACQUIRE) == seen){
+         pthread_mutex_lock(&s->lock);
+         __atomic_fetch_add(&s->sleepers, 1, __ATOMIC_SEQ_CST);
+         while(__atomic_load_n(&s->generation, __ATOMIC_SEQ_CST) == seen){
+            pthread_cond_wait(&s->wake, &s->lock);
+         }
+         __atomic_fetch_sub(&s->sleepers, 1, __ATOMIC_SEQ_CST);
+         pthread_mutex_unlock(&s->lock);
+      }
+      seen = __atomic_load_n(&s->generation, __ATOMIC_ACQUIRE);
+      if(__atomic_load_n(&s->quit, __ATOMIC_ACQUIRE)){
+         return NULL;
+      }
+      schedRunJob(worker);
+      __atomic_fetch_add(&s->finished, 1, __ATOMIC_RELEASE);
+   }
+}
+
+// Starts workerCount - 1 threads, workerStart may be NULL. Returns NULL on
+// failure.
+static inline taskScheduler* schedCreate(int workerCount, schedWorkerStartFunction workerStart){
+   taskScheduler* s = (taskScheduler*)calloc(1, sizeof(taskScheduler));
+   if(!s){
+      return NULL;
+   }
+   s->workerCount = workerCount > 0 ? workerCount : 1;
+   s->workers = (schedWorker*)aligned_alloc(64, sizeof(schedWorker) * s->workerCount);
+   if(!s->workers){
+      free(s);
+      return NULL;
+   }
+   s->workerStart = workerStart;
+   pthread_mutex_init(&s->lock, NULL);
+   pthread_cond_init(&s->wake, NULL);
+   for(int w = 0; w < s->workerCount; ++w){
+      schedWorker* worker = &s->workers[w];
+      *worker = (schedWorker){.scheduler = s, .id = w, .random = 2654435761u * (w + 1)};
+      if(w > 0 && pthread_create(&worker->thread, NULL, schedWorkerMain, worker)){
+         printf("Could not start scheduler worker %d, using %d\n", w, w);
+         s->workerCount = w;
+         break;
+      }
+   }
+   if(workerStart){
+      workerStart(0, s->workerCount);
+   }
+   return s;
+}
+
+// Runs body over [0, count) and returns when all of it has run. Must only
+// be called from the thread that created the scheduler.
+static inline void schedParallelFor(taskScheduler* s, int count, int grain,
+                                    schedRangeFunction body, void* context,
+                                    int tracePhase){
+   if(count <= 0){
+      return;
+   }
+   s->body = body;
+   s->context = context;
+   s->grain = grain > 0 ? grain : 1;
+   s->tracePhase = tracePhase;
+   s->finished = 0;
+   __atomic_store_n(&s->remaining, count, __ATOMIC_RELAXED);
+   // No worker is inside a job here, so the deques can be seeded directly
+   for(int w = 0; w < s->workerCount; ++w){
+      schedDeque* d = &s->workers[w].deque;
+      d->top = d->bottom = 0;
+      int begin = (int)((int64_t)count * w / s->workerCount);
+      int end = (int)((int64_t)count * (w + 1) / s->workerCount);
+      if(end > begin){
+         schedPush(d, schedMakeRange(begin, end));
+      }
+   }
+
+   __atomic_fetch_add(&s->generation, 1, __ATOMIC_SEQ_CST);
+   if(__atomic_load_n(&s->sleepers, __ATOMIC_SEQ_CST) > 0){
+      pthread_mutex_lock(&s->lock);
+      pthread_cond_broadcast(&s->wake);
+      pthread_mutex_unlock(&s->lock);
+   }
+   schedRunJob(&s->workers[0]);
+   while(__atomic_load_n(&s->finished, __ATOMIC_ACQUIRE) < s->workerCount - 1){
+      sched_yield();
+   }
+}
+
+// Prints how many tasks every worker ran and stole
+static inline void schedPrintStatistics(const taskScheduler* s, FILE* out){
+   for(int w = 0; w < s->workerCount; ++w){
+      fprintf(out, "Scheduler worker %d: %llu tasks, %llu stolen\n", w,
+         (unsigned long long)s->workers[w].tasks,
+         (unsigned long long)s->workers[w].steals);
+   }
+}
+
+static inline void schedDestroy(taskScheduler* s){
+   if(!s){
+      return;
+   }
+   pthread_mutex_lock(&s->lock);
+   __atomic_store_n(&s->quit, 1, __ATOMIC_RELEASE);
+   __atomic_fetch_add(&s->generation, 1, __ATOMIC_SEQ_CST);
+   pthread_cond_broadcast(&s->wake);
+   pthread_mutex_unlock(&s->lock);
+   for(int w = 1; w < s->workerCount; ++w){
+      pthread_join(s->workers[w].thread, NULL);
+   }
+   pthread_mutex_destroy(&s->lock);
+   pthread_cond_destroy(&s->wake);
+   free(s->workers);
+   free(s);
+}
+
+#endif
@@ -0,0 +1,304 @@
+// Per-phase instrumentation with nanosecond timers.
+//
+// Every finished span goes into a per-thread histogram, and, when a trace
+// file was requested, into a per-thread event buffer that traceWrite()
+// exports in the Chrome trace-event format (load it in chrome://tracing or
+// https://ui.perfetto.dev). traceSummary() prints the aggregated
+// histograms.
+//
+// Spans are scoped with the GNU cleanup attribute:
+//
+//    {
+//       TRACE_SCOPE(TRACE_PHYSICS);
+//       ...               // timed until the end of the block
+//    }
+//
+// Threads get small ids in order of their first span, so the OpenMP
+// master thread is normally 0. Spans recorded inside parallel regions show
+// how long every thread worked on its share, which is what exposes load
+// imbalance.
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "clock.h"
+
+typedef enum{
+   TRACE_FRAME,
+   TRACE_PHYSICS,
+   TRACE_COLORING,
+   TRACE_UPLOAD,
+   TRACE_KERNEL,
+   TRACE_READBACK,
+   TRACE_VALIDATION,
+   TRACE_DISPLAY,
+   TRACE_RECORD,
+   TRACE_PHYSICS_THREAD,
+   TRACE_COLORING_THREAD,
+   TRACE_PHASE_COUNT
+} tracePhase;
+
+static const char* const tracePhaseNames[TRACE_PHASE_COUNT] = {
+   "frame", "physics", "coloring", "upload", "kernel", "readback",
+   "validation", "display", "record", "physics thread", "coloring thread"
+};
+
+#define TRACE_MAX_THREADS 256
+// Four buckets per power of two, 1ns ... 2^40ns
+#define TRACE_BUCKETS (41 * 4)
+// Upper bound for buffered events per thread, later events only count
+#define TRACE_MAX_EVENTS (1 << 22)
+
+typedef struct{
+   uint64_t start;
+   uint32_t duration;   // saturates at ~4.3 s
+   uint16_t phase;
+   uint32_t frame;
+} traceEvent;
+
+typedef struct{
+   uint64_t count[TRACE_PHASE_COUNT];
+   uint64_t total[TRACE_PHASE_COUNT];
+   uint64_t minimum[TRACE_PHASE_COUNT];
+   uint64_t maximum[TRACE_PHASE_COUNT];
+   uint32_t buckets[TRACE_PHASE_COUNT][TRACE_BUCKETS];
+   traceEvent* events;
+   size_t eventCount;
+   size_t eventCapacity;
+   size_t eventsDropped;
+} traceThread;
+
+typedef struct{
+   int enabled;
+   int recordEvents;
+   uint64_t origin;
+   unsigned int frame;
+   int threadCount;
+   traceThread* threads[TRACE_MAX_THREADS];
+   // Optional callbacks at span boundaries, e.g. to read hardware counters
+   void (*spanBegin)(int phase);
+   void (*spanEnd)(int phase);
+} traceState;
+
+static traceState traceGlobal;
+static __thread int traceThreadId = -1;
+
+// Enables tracing. Events are only buffered when they will be exported.
+static inline void traceInit(int recordEvents){
+   traceGlobal.enabled = 1;
+   traceGlobal.recordEvents = recordEvents;
+   traceGlobal.origin = nowNanoseconds();
+}
+
+static inline void traceSetFrame(unsigned int frame){
+   traceGlobal.frame = frame;
+}
+
+static inline traceThread* traceCurrentThread(void){
+   if(traceThreadId < 0){
+      int id = __atomic_fetch_add(&traceGlobal.threadCount, 1, __ATOMIC_RELAXED);
+      if(id >= TRACE_MAX_THREADS){
+         return NULL;
+      }
+      traceThread* thread = (traceThread*)calloc(1, sizeof(traceThread));
+      if(!thread){
+         return NULL;
+      }
+      for(int p = 0; p < TRACE_PHASE_COUNT; ++p){
+         thread->minimum[p] = UINT64_MAX;
+      }
+      traceGlobal.threads[id] = thread;
+      traceThreadId = id;
+   }
+   return traceThreadId < TRACE_MAX_THREADS ? traceGlobal.threads[traceThreadId] : NULL;
+}
+
+static inline int traceBucket(uint64_t duration){
+   if(duration < 4){
+      return (int)duration;
+   }
+   int exponent = 63 - __builtin_clzll(duration);
+   int bucket = exponent * 4 + (int)((duration >> (exponent - 2)) & 3);
+   return bucket < TRACE_BUCKETS ? bucket : TRACE_BUCKETS - 1;
+}
+
+// Lower edge of a bucket in nanoseconds
+static inline uint64_t traceBucketStart(int bucket){
+   if(bucket < 4){
+      return (uint64_t)bucket;
+   }
+   int exponent = bucket / 4;
+   if(exponent < 2){
+      return 1ull << exponent;
+   }
+   return (1ull << exponent) + (uint64_t)(bucket % 4) * (1ull << (exponent - 2));
+}
+
+// Records a finished span that started at start
+static inline void traceRecord(int phase, uint64_t start, uint64_t end){
+   traceThread* thread = traceGlobal.enabled ? traceCurrentThread() : NULL;
+   if(!thread){
+      return;
+   }
+   uint64_t duration = end - start;
+   thread->count[phase]++;
+   thread->total[phase] += duration;
+   if(duration < thread->minimum[phase]) thread->minimum[phase] = duration;
+   if(duration > thread->maximum[phase]) thread->maximum[phase] = duration;
+   thread->buckets[phase][traceBucket(duration)]++;
+
+   if(!traceGlobal.recordEvents){
+      return;
+   }
+   if(thread->eventCount == thread->eventCapacity){
+      size_t capacity = thread->eventCapacity ? thread->eventCapacity * 2 : 4096;
+      traceEvent* events = capacity <= TRACE_MAX_EVENTS ?
+         (traceEvent*)realloc(thread->events, capacity * sizeof(traceEvent)) : NULL;
+      if(!events){
+         thread->eventsDropped++;
+         return;
+      }
+      thread->events = events;
+      thread->eventCapacity = capacity;
+   }
+   traceEvent* event = &thread->events[thread->eventCount++];
+   event->start = start - traceGlobal.origin;
+   event->duration = duration > UINT32_MAX ? UINT32_MAX : (uint32_t)duration;
+   event->phase = (uint16_t)phase;
+   event->frame = traceGlobal.frame;
+}
+
+typedef struct{
+   int phase;
+   uint64_t start;
+} traceScope;
+
+static inline traceScope traceScopeBegin(int phase){
+   traceScope scope = {.phase = phase, .start = 0};
+   if(traceGlobal.enabled){
+      if(traceGlobal.spanBegin && traceCurrentThread()){
+         traceGlobal.spanBegin(phase);
+      }
+      scope.start = nowNanoseconds();
+   }
+   return scope;
+}
+
+static inline void traceScopeEnd(traceScope* scope){
+   if(traceGlobal.enabled){
+      traceRecord(scope->phase, scope->start, nowNanoseconds());
+      if(traceGlobal.spanEnd){
+         traceGlobal.spanEnd(scope->phase);
+      }
+   }
+}
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(phase) \
+   traceScope TRACE_CONCAT(traceScope_, __LINE__) \
+      __attribute__((cleanup(traceScopeEnd))) = traceScopeBegin(phase)
+
+// Writes all buffered events as Chrome trace-event JSON. Returns 0 on success.
+static inline int traceWrite(const char* path){
+   FILE* file = fopen(path, "w");
+   if(!file){
+      return -1;
+   }
+   fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+   int first = 1;
+   for(int t = 0; t < traceGlobal.threadCount && t < TRACE_MAX_THREADS; ++t){
+      traceThread* thread = traceGlobal.threads[t];
+      if(!thread){
+         continue;
+      }
+      fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+         "\"args\":{\"name\":\"%s %d\"}}", first ? "" : ",\n", t,
+         t == 0 ? "main" : "worker", t);
+      first = 0;
+      for(size_t e = 0; e < thread->eventCount; ++e){
+         const traceEvent* event = &thread->events[e];
+         fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+            "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"frame\":%u}}",
+            tracePhaseNames[event->phase], t, event->start / 1e3,
+            event->duration / 1e3, event->frame);
+      }
+   }
+   fprintf(file, "\n]}\n");
+   return fclose(file) == 0 ? 0 : -1;
+}
+
+// Percentile of a merged histogram: the middle of the bucket it falls in,
+// clamped to the observed range (buckets are about 19% wide)
+static inline uint64_t tracePercentile(const uint64_t* buckets, uint64_t count, double fraction,
+                                       uint64_t minimum, uint64_t maximum){
+   uint64_t target = (uint64_t)(fraction * (count - 1));
+   uint64_t seen = 0;
+   for(int b = 0; b < TRACE_BUCKETS; ++b){
+      seen += buckets[b];
+      if(seen > target){
+         uint64_t middle = (traceBucketStart(b) + traceBucketStart(b + 1)) / 2;
+         return middle < minimum ? minimum : middle > maximum ? maximum : middle;
+      }
+   }
+   return maximum;
+}
+
+// Prints per phase statistics over all threads. Per-thread spans also get
+// the spread between the slowest and the fastest thread.
+static inline void traceSummary(FILE* out){
+   if(!traceGlobal.enabled){
+      return;
+   }
+   fprintf(out, "%-16s %8s %10s %10s %10s %10s %10s %10s\n", "phase", "count",
+      "mean us", "min us", "p50 us", "p95 us", "p99 us", "max us");
+   for(int p = 0; p < TRACE_PHASE_COUNT; ++p){
+      uint64_t buckets[TRACE_BUCKETS] = {0};
+      uint64_t count = 0, total = 0, minimum = UINT64_MAX, maximum = 0;
+      uint64_t slowestThread = 0, fastestThread = UINT64_MAX;
+      int threads = 0;
+      for(int t = 0; t < traceGlobal.threadCount && t < TRACE_MAX_THREADS; ++t){
+         traceThread* thread = traceGlobal.threads[t];
+         if(!thread || thread->count[p] == 0){
+            continue;
+         }
+         threads++;
+         count += thread->count[p];
+         total += thread->total[p];
+         if(thread->minimum[p] < minimum) minimum = thread->minimum[p];
+         if(thread->maximum[p] > maximum) maximum = thread->maximum[p];
+         if(thread->total[p] > slowestThread) slowestThread = thread->total[p];
+         if(thread->total[p] < fastestThread) fastestThread = thread->total[p];
+         for(int b = 0; b < TRACE_BUCKETS; ++b){
+            buckets[b] += thread->buckets[p][b];
+         }
+      }
+      if(count == 0){
+         continue;
+      }
+      fprintf(out, "%-16s %8llu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f",
+         tracePhaseNames[p], (unsigned long long)count, total / 1e3 / count,
+         minimum / 1e3, tracePercentile(buckets, count, 0.5, minimum, maximum) / 1e3,
+         tracePercentile(buckets, count, 0.95, minimum, maximum) / 1e3,
+         tracePercentile(buckets, count, 0.99, minimum, maximum) / 1e3, maximum / 1e3);
+      if(threads > 1){
+         fprintf(out, "  %d threads, busiest/idlest %.2f", threads,
+            (double)slowestThread / (fastestThread ? fastestThread : 1));
+      }
+      fprintf(out, "\n");
+   }
+   size_t dropped = 0;
+   for(int t = 0; t < traceGlobal.threadCount && t < TRACE_MAX_THREADS; ++t){
+      dropped += traceGlobal.threads[t] ? traceGlobal.threads[t]->eventsDropped : 0;
+   }
+   if(dropped > 0){
+      fprintf(out, "%zu trace events were not buffered (limit %d per thread)\n",
+         dropped, TRACE_MAX_EVENTS);
+   }
+}
+
+#endif
@@ -0,0 +1,268 @@
+// Frame validation against the sequential reference renderer.
+//
+// Instead of rendering the whole reference frame serially and stopping at
+// the first bad pixel, the validator
+//   - renders the reference in parallel, either for every pixel or for a
+//     sampled subset of tiles (one tile in sampleRate, a different subset
+//     every frame, plus every tile a hot spot such as a satelite disc of
+//     hotSpotRadius overlaps)
+//   - compares with SIMD reductions and reports the max and mean error,
+//     the worst pixel and the number of pixels over the limit.
+//
+// Frames are float RGB, three floats per pixel, like the pixels buffer.
+#ifndef VALIDATE_H
+#define VALIDATE_H
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define VALIDATE_TILE 16
+
+typedef enum{
+   VALIDATE_OFF,
+   VALIDATE_FULL,
+   VALIDATE_SAMPLED
+} validationMode;
+
+typedef struct{
+   double maxError;      // largest channel difference
+   double meanError;     // mean channel difference
+   long worstPixel;      // pixel with maxError, -1 if nothing was compared
+   long badPixels;       // pixels with a channel difference over the limit
+   long comparedPixels;
+} validationReport;
+
+typedef struct{
+   int width;
+   int height;
+   validationMode mode;
+   int sampleRate;
+   double allowedError;
+   float* reference;     // reference frame, only checked pixels are written
+   long* indices;        // pixels checked in the current frame
+   unsigned char* tiles; // tiles checked in the current frame
+   float hotSpotRadius;  // pixels around a hot spot that are always checked
+} validator;
+
+// Renders the reference color of one pixel into out[0..2]
+typedef void (*referencePixelFunction)(long pixel, float* out, void* context);
+
+// Parses "full", "off", "sample" or "sample:N". reference is a frame sized
+// scratch buffer owned by the caller. Returns NULL on a bad mode.
+static inline validator* validatorCreate(int width, int height, const char* mode,
+                                         double allowedError, float* reference){
+   validator* v = (validator*)calloc(1, sizeof(validator));
+   if(!v){
+      return NULL;
+   }
+   v->width = width;
+   v->height = height;
+   v->allowedError = allowedError;
+   v->reference = reference;
+   v->sampleRate = 16;
+   if(!mode || strcmp(mode, "full") == 0){
+      v->mode = VALIDATE_FULL;
+   } else if(strcmp(mode, "off") == 0){
+      v->mode = VALIDATE_OFF;
+   } else if(strncmp(mode, "sample", 6) == 0){
+      v->mode = VALIDATE_SAMPLED;
+      if(mode[6] == ':'){
+         v->sampleRate = atoi(mode + 7);
+      }
+      if(v->sampleRate < 1){
+         free(v);
+         return NULL;
+      }
+   } else {
+      free(v);
+      return NULL;
+   }
+   if(v->mode == VALIDATE_SAMPLED){
+      int tiles = ((width + VALIDATE_TILE - 1) / VALIDATE_TILE) *
+                  ((height + VALIDATE_TILE - 1) / VALIDATE_TILE);
+      v->indices = (long*)malloc(sizeof(long) * width * height);
+      v->tiles = (unsigned char*)malloc(tiles);
+      if(!v->indices || !v->tiles){
+         free(v->indices);
+         free(v->tiles);
+         free(v);
+         return NULL;
+      }
+   }
+   return v;
+}
+
+static inline void validatorDestroy(validator* v){
+   if(v){
+      free(v->indices);
+      free(v->tiles);
+      free(v);
+   }
+}
+
+// Cheap integer hash used to pick a different tile subset every frame
+static inline uint32_t validateHash(uint32_t value){
+   value ^= value >> 16;
+   value *= 0x7feb352du;
+   value ^= value >> 15;
+   value *= 0x846ca68bu;
+   value ^= value >> 16;
+   return value;
+}
+
+// Collects the pixels of the sampled tiles. hotSpots holds x, y pairs,
+// every tile overlapped by the square of hotSpotRadius around one is
+// selected. Hot spots entirely off the frame select nothing.
+static inline long validateSelectPixels(validator* v, unsigned int frame,
+                                        const float* hotSpots, int hotSpotCount){
+   int tilesX = (v->width + VALIDATE_TILE - 1) / VALIDATE_TILE;
+   int tilesY = (v->height + VALIDATE_TILE - 1) / VALIDATE_TILE;
+   for(int tile = 0; tile < tilesX * tilesY; ++tile){
+      v->tiles[tile] = validateHash((uint32_t)tile ^ validateHash(frame)) % v->sampleRate == 0;
+   }
+   float r = v->hotSpotRadius;
+   for(int h = 0; h < hotSpotCount; ++h){
+      float left = floorf(hotSpots[2 * h] - r), right = floorf(hotSpots[2 * h] + r);
+      float top = floorf(hotSpots[2 * h + 1] - r), bottom = floorf(hotSpots[2 * h + 1] + r);
+      // Written so that NaN positions are skipped too
+      if(!(right >= 0.f && left < v->width && bottom >= 0.f && top < v->height)){
+         continue;
+      }
+      int x0 = left > 0.f ? (int)left / VALIDATE_TILE : 0;
+      int x1 = right < v->width ? (int)right / VALIDATE_TILE : tilesX - 1;
+      int y0 = top > 0.f ? (int)top / VALIDATE_TILE : 0;
+      int y1 = bottom < v->height ? (int)bottom / VALIDATE_TILE : tilesY - 1;
+      for(int ty = y0; ty <= y1; ++ty){
+         memset(v->tiles + ty * tilesX + x0, 1, x1 - x0 + 1);
+      }
+   }
+
+   long count = 0;
+   for(int ty = 0; ty < tilesY; ++ty){
+      for(int tx = 0; tx < tilesX; ++tx){
+         if(!v->tiles[ty * tilesX + tx]){
+            continue;
+         }
+         for(int y = ty * VALIDATE_TILE; y < (ty + 1) * VALIDATE_TILE && y < v->height; ++y){
+            for(int x = tx * VALIDATE_TILE; x < (tx + 1) * VALIDATE_TILE && x < v->width; ++x){
+               v->indices[count++] = (long)y * v->width + x;
+            }
+         }
+      }
+   }
+   return count;
+}
+
+// Error statistics of the listed pixels (or all pixels when indices is
+// NULL). Runs over blocks: the max of a block is a SIMD reduction and only
+// a block that beats the best so far is scanned again for its worst pixel.
+static inline validationReport validateCompare(const float* expected, const float* actual,
+                                               const long* indices, long count,
+                                               double allowedError){
+   const long block = 1024;
+   double maxError = 0.0;
+   double errorSum = 0.0;
+   long worstPixel = -1;
+   long badPixels = 0;
+
+#pragma omp parallel
+   {
+      float localMax = -1.f;
+      long localWorst = -1;
+
+#pragma omp for reduction(+:errorSum, badPixels) schedule(static)
+      for(long start = 0; start < count; start += block){
+         long end = start + block < count ? start + block : count;
+         float blockMax = 0.f;
+         double blockSum = 0.0;
+         long blockBad = 0;
+
+#pragma omp simd reduction(max:blockMax) reduction(+:blockSum, blockBad)
+         for(long n = start; n < end; ++n){
+            long i = indices ? indices[n] : n;
+            float red = fabsf(expected[3 * i] - actual[3 * i]);
+            float green = fabsf(expected[3 * i + 1] - actual[3 * i + 1]);
+            float blue = fabsf(expected[3 * i + 2] - actual[3 * i + 2]);
+            float pixelMax = fmaxf(red, fmaxf(green, blue));
+            blockMax = fmaxf(blockMax, pixelMax);
+            blockSum += red + green + blue;
+            blockBad += pixelMax > allowedError;
+         }
+         errorSum += blockSum;
+         badPixels += blockBad;
+
+         if(blockMax > localMax){
+            for(long n = start; n < end; ++n){
+               long i = indices ? indices[n] : n;
+               float pixelMax = fmaxf(fabsf(expected[3 * i] - actual[3 * i]),
+                  fmaxf(fabsf(expected[3 * i + 1] - actual[3 * i + 1]),
+                        fabsf(expected[3 * i + 2] - actual[3 * i + 2])));
+               if(pixelMax == blockMax){
+                  localWorst = i;
+                  break;
+               }
+            }
+            localMax = blockMax;
+         }
+      }
+
+#pragma omp critical
+      if(localWorst >= 0 && (localMax > maxError || worstPixel < 0)){
+         maxError = localMax;
+         worstPixel = localWorst;
+      }
+   }
+
+   validationReport report = {.maxError = maxError,
+      .meanError = count > 0 ? errorSum / (3.0 * count) : 0.0,
+      .worstPixel = worstPixel, .badPixels = badPixels, .comparedPixels = count};
+   return report;
+}
+
+// Renders the reference for the pixels chosen by the validator's mode and
+// compares them with actual
+static inline validationReport validateFrame(validator* v, const float* actual,
+                                             unsigned int frame,
+                                             const float* hotSpots, int hotSpotCount,
+                                             referencePixelFunction reference,
+                                             void* context){
+   validationReport empty = {.worstPixel = -1};
+   if(v->mode == VALIDATE_OFF){
+      return empty;
+   }
+   long count = (long)v->width * v->height;
+   const long* indices = NULL;
+   if(v->mode == VALIDATE_SAMPLED){
+      count = validateSelectPixels(v, frame, hotSpots, hotSpotCount);
+      indices = v->indices;
+   }
+
+   // Reference pixels cost very different amounts, hence dynamic
+#pragma omp parallel for schedule(dynamic, 256)
+   for(long n = 0; n < count; ++n){
+      long i = indices ? indices[n] : n;
+      reference(i, v->reference + 3 * i, context);
+   }
+   return validateCompare(v->reference, actual, indices, count, v->allowedError);
+}
+
+// Prints one line; returns 1 if the frame passed
+static inline int printValidationReport(const validationReport* report, int width,
+                                        double allowedError, const char* label){
+   int passed = report->badPixels == 0;
+   if(report->worstPixel < 0){
+      printf("%s: nothing to check\n", label);
+      return 1;
+   }
+   printf("%s %s: max error %.5f at (x=%li, y=%li), mean error %.6f, "
+      "%li of %li checked pixels over %.3f\n",
+      label, passed ? "passed" : "FAILED", report->maxError,
+      report->worstPixel % width, report->worstPixel / width,
+      report->meanError, report->badPixels, report->comparedPixels, allowedError);
+   return passed;
+}
+
+#endif
@@ -1,77 +1,50 @@
-#include <stdio.h>                                                                                                                                               
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #ifdef __APPLE__
 #include <OpenCL/opencl.h>
 #else
 #include <CL/cl.h>
 #endif
 
-int main() {
+#include "common/cl_probe.h"
 
-    int i, j;
-    char* value;
-    size_t valueSize;
-    cl_uint platformCount;
-    cl_platform_id* platforms;
-    cl_uint deviceCount;
-    cl_device_id* devices;
-    cl_uint maxComputeUnits;
+// Prints the attributes of every OpenCL device, or with --json the
+// records of common/cl_probe.h for the inventory
+int main(int argc, char** argv) {
 
-    // get all platforms
-    clGetPlatformIDs(0, NULL, &platformCount);
-    platforms = (cl_platform_id*) malloc(sizeof(cl_platform_id) * platformCount);
-    clGetPlatformIDs(platformCount, platforms, NULL);
+    static clProbe probe;
+    int j = 0;
+    cl_platform_id platform = NULL;
 
-    for (i = 0; i < platformCount; i++) {
-
-        // get all devices
-        clGetDeviceIDs(platforms[i], CL_DEVICE_TYPE_ALL, 0, NULL, &deviceCount);
-        devices = (cl_device_id*) malloc(sizeof(cl_device_id) * deviceCount);
-        clGetDeviceIDs(platforms[i], CL_DEVICE_TYPE_ALL, deviceCount, devices, NULL);
-
-        // for each device print critical attributes
-        for (j = 0; j < deviceCount; j++) {
-
-            // print device name
-            clGetDeviceInfo(devices[j], CL_DEVICE_NAME, 0, NULL, &valueSize);
-            value = (char*) malloc(valueSize);
-            clGetDeviceInfo(devices[j], CL_DEVICE_NAME, valueSize, value, NULL);
-            printf("%d. Device: %s\n", j+1, value);
-            free(value);
-
-            // print hardware device version
-            clGetDeviceInfo(devices[j], CL_DEVICE_VERSION, 0, NULL, &valueSize);
-            value = (char*) malloc(valueSize);
-            clGetDeviceInfo(devices[j], CL_DEVICE_VERSION, valueSize, value, NULL);
-            printf(" %d.%d Hardware version: %s\n", j+1, 1, value);
-            free(value);
-
-            // print software driver version
-            clGetDeviceInfo(devices[j], CL_DRIVER_VERSION, 0, NULL, &valueSize);
-            value = (char*) malloc(valueSize);
-            clGetDeviceInfo(devices[j], CL_DRIVER_VERSION, valueSize, value, NULL);
-            printf(" %d.%d Software version: %s\n", j+1, 2, value);
-            free(value);
-
-            // print c version supported by compiler for device
-            clGetDeviceInfo(devices[j], CL_DEVICE_OPENCL_C_VERSION, 0, NULL, &valueSize);
-            value = (char*) malloc(valueSize);
-            clGetDeviceInfo(devices[j], CL_DEVICE_OPENCL_C_VERSION, valueSize, value, NULL);
-            printf(" %d.%d OpenCL C version: %s\n", j+1, 3, value);
-            free(value);
-
-            // print parallel compute units
-            clGetDeviceInfo(devices[j], CL_DEVICE_MAX_COMPUTE_UNITS,
-                    sizeof(maxComputeUnits), &maxComputeUnits, NULL);
-            printf(" %d.%d Parallel compute units: %d\n", j+1, 4, maxComputeUnits);
-
-        }
+    clProbeDevices(&probe);
+    if (argc > 1 && strcmp(argv[1], "--json") == 0) {
+        clProbeWriteJSON(stdout, &probe);
+        return 0;
+    }
 
-        free(devices);
+    for (int d = 0; d < probe.count; d++) {
+        const clDeviceRecord* r = &probe.devices[d];
+
+        // numbering restarts on every platform
+        j = r->platform == platform ? j + 1 : 0;
+        platform = r->platform;
+
+        printf("%d. Device: %s\n", j+1, r->name);
+        printf(" %d.%d Hardware version: %s\n", j+1, 1, r->version);
+        printf(" %d.%d Software version: %s\n", j+1, 2, r->driverVersion);
+        printf(" %d.%d OpenCL C version: %s\n", j+1, 3, r->openclCVersion);
+        printf(" %d.%d Parallel compute units: %u\n", j+1, 4, r->computeUnits);
+        printf(" %d.%d Max work group size: %zu\n", j+1, 5, r->maxWorkGroupSize);
+        printf(" %d.%d Local memory: %llu KB\n", j+1, 6,
+                (unsigned long long)(r->localMemory / 1024));
+        printf(" %d.%d Preferred vector width float/double: %u/%u\n", j+1, 7,
+                r->preferredVectorFloat, r->preferredVectorDouble);
+        printf(" %d.%d Double precision: %s\n", j+1, 8, r->fp64 ? "yes" : "no");
+        printf(" %d.%d Unified memory: %s\n", j+1, 9, r->unifiedMemory ? "yes" : "no");
 
     }
 
-    free(platforms);
     return 0;
 
 }
@@ -0,0 +1,501 @@
+// Performance regression gate: runs the engines in fixed headless
+// scenarios and compares their frame times with a baseline recorded on the
+// same class of machine.
+//
+// Compilation on linux:
+//   gcc -o perfgate perfgate.c -std=c99 -O2 -lm
+// Usage, from the repository root with ./parallel built in OpenMP/ and OpenCL/:
+//   ./perfgate --record [--runs=9]         writes perf/baselines/<machine class>.txt
+//   ./perfgate [--runs=5] [--csv=path]     compares with it, exits 1 on a regression
+// Options:
+//   --scenarios=perf/scenarios.txt  --baselines=perf/baselines  --machine=name
+//   --only=name,name  --warmup=2 (frames dropped per run)
+//   --threshold=5 (% for medians)  --threshold-p95=10 (% for p95)  --alpha=0.01
+//
+// A scenario is one command line of perf/scenarios.txt: an ensemble run
+// with a fixed seed, scene count, satelite count, color mode and thread
+// count. Each run of it gives per frame the physics time, the coloring
+// time and their sum, the frame time, from its "Ensemble frame" lines.
+// The first --warmup frames are dropped (page faults, kernel builds,
+// cold caches), the median and p95 over the rest are the metrics of the
+// run. Runs of all scenarios are interleaved, so drift of the machine
+// (clock boost, thermal limits, other load) spreads over every scenario
+// instead of hitting the last one.
+//
+// The machine class is the CPU model and its online CPU count unless
+// --machine names it, so baselines are only compared on comparable
+// hardware. A baseline keeps every recorded run, not just a mean, and a
+// metric regresses only when both
+//   - its median over the runs grew by more than the threshold, and
+//   - the current runs are slower than the baseline runs by a one-sided
+//     Mann-Whitney U test below --alpha, exact over all orderings of the
+//     runs, so one slow outlier run can not fail the gate.
+// A change over the threshold that the test does not confirm is reported
+// as noise. With too few runs no change can reach --alpha, which is
+// warned about. Exit status: 0 no regression, 1 regression, 2 a scenario
+// failed to run or there is no baseline.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include <unistd.h>
+
+#include "common/options.h"
+
+#define MAX_SCENARIOS 64
+#define MAX_RUNS 64
+#define MAX_FRAMES 4096
+#define TEXT 1024
+
+#define EXIT_REGRESSION 1
+#define EXIT_SETUP 2
+
+typedef enum{
+   METRIC_FRAME_P50,
+   METRIC_FRAME_P95,
+   METRIC_PHYSICS_P50,
+   METRIC_PHYSICS_P95,
+   METRIC_COLORING_P50,
+   METRIC_COLORING_P95,
+   METRIC_COUNT
+} gateMetric;
+
+static const char* metricNames[METRIC_COUNT] = {
+   "frame.p50", "frame.p95", "physics.p50", "physics.p95", "coloring.p50", "coloring.p95"
+};
+
+typedef struct{
+   char name[64];
+   char directory[256];
+   char command[TEXT];
+   int selected;
+   int failed;
+   int runs;                                   // this session
+   double values[METRIC_COUNT][MAX_RUNS];      // ms per run
+   int baselineRuns;
+   double baseline[METRIC_COUNT][MAX_RUNS];
+} gateScenario;
+
+static int compareDoubles(const void* a, const void* b){
+   double x = *(const double*)a, y = *(const double*)b;
+   return x < y ? -1 : x > y;
+}
+
+// Linear interpolation between the closest ranks
+static double percentile(const double* values, int count, double fraction){
+   if(count <= 0){
+      return 0.0;
+   }
+   double* sorted = (double*)malloc(sizeof(double) * count);
+   memcpy(sorted, values, sizeof(double) * count);
+   qsort(sorted, count, sizeof(double), compareDoubles);
+   double rank = fraction * (count - 1);
+   int below = (int)rank;
+   int above = below + 1 < count ? below + 1 : below;
+   double result = sorted[below] + (rank - below) * (sorted[above] - sorted[below]);
+   free(sorted);
+   return result;
+}
+
+// Probability that runs of two equal distributions, n and m of them, give
+// a U statistic of at least u. The counts of orderings per U are the
+// coefficients of the Gaussian binomial [n + m choose n](q), built as
+// prod (1 - q^(m + i)) / (1 - q^i) for i = 1..n. Ties count half in u, and
+// the probability is taken from the whole step below, which keeps it on
+// the conservative side.
+static double mannWhitneyTail(int n, int m, double u){
+   int degree = n * m;
+   double* counts = (double*)calloc(degree + 1, sizeof(double));
+   counts[0] = 1.0;
+   for(int i = 1; i <= n; ++i){
+      for(int k = degree; k >= m + i; --k){
+         counts[k] -= counts[k - m - i];
+      }
+      for(int k = i; k <= degree; ++k){
+         counts[k] += counts[k - i];
+      }
+   }
+   double total = 0.0, tail = 0.0;
+   int from = (int)ceil(u - 0.5);
+   for(int k = 0; k <= degree; ++k){
+      total += counts[k];
+      tail += k >= from ? counts[k] : 0.0;
+   }
+   free(counts);
+   return tail / total;
+}
+
+// One-sided p-value that the current runs are slower than the baseline
+// runs (slower = 1) or faster (slower = 0)
+static double mannWhitneyP(const double* baseline, int n, const double* current, int m, int slower){
+   double u = 0.0;
+   for(int i = 0; i < n; ++i){
+      for(int j = 0; j < m; ++j){
+         u += current[j] > baseline[i] ? 1.0 : current[j] == baseline[i] ? 0.5 : 0.0;
+      }
+   }
+   return mannWhitneyTail(n, m, slower ? u : n * m - u);
+}
+
+// Smallest p-value n against m runs can reach: one ordering of all
+static double mannWhitneyFloor(int n, int m){
+   double orderings = 1.0;
+   for(int i = 1; i <= n; ++i){
+      orderings = orderings * (m + i) / i;
+   }
+   return 1.0 / orderings;
+}
+
+// CPU model and online CPU count as a file name, like
+// "intel-r-core-tm-i7-8700-cpu-3-20ghz-12cpu"
+static void machineClass(char* out, size_t size){
+   char model[256] = "unknown-cpu";
+   FILE* cpuinfo = fopen("/proc/cpuinfo", "r");
+   if(cpuinfo){
+      char line[TEXT];
+      while(fgets(line, sizeof(line), cpuinfo)){
+         char* colon = strchr(line, ':');
+         if(colon && (strncmp(line, "model name", 10) == 0 || strncmp(line, "Model", 5) == 0 ||
+                      strncmp(line, "cpu model", 9) == 0)){
+            snprintf(model, sizeof(model), "%s", colon + 1);
+            break;
+         }
+      }
+      fclose(cpuinfo);
+   }
+   size_t length = 0;
+   int dash = 1;
+   for(const char* c = model; *c && length + 1 < size; ++c){
+      if(isalnum((unsigned char)*c)){
+         out[length++] = (char)tolower((unsigned char)*c);
+         dash = 0;
+      } else if(!dash){
+         out[length++] = '-';
+         dash = 1;
+      }
+   }
+   while(length > 0 && out[length - 1] == '-'){
+      --length;
+   }
+   snprintf(out + length, size - length, "-%ldcpu", sysconf(_SC_NPROCESSORS_ONLN));
+}
+
+// Reads "name directory command..." lines, # starts a comment
+static int readScenarios(const char* path, gateScenario* scenarios){
+   FILE* file = fopen(path, "r");
+   if(!file){
+      return -1;
+   }
+   int count = 0;
+   char line[TEXT];
+   while(fgets(line, sizeof(line), file) && count < MAX_SCENARIOS){
+      line[strcspn(line, "\r\n")] = '\0';
+      gateScenario* s = &scenarios[count];
+      int commandStart = 0;
+      if(line[strspn(line, " \t")] == '#' ||
+         sscanf(line, " %63s %255s %n", s->name, s->directory, &commandStart) < 2 ||
+         commandStart == 0 || line[commandStart] == '\0'){
+         continue;
+      }
+      snprintf(s->command, sizeof(s->command), "%s", line + commandStart);
+      s->selected = 1;
+      ++count;
+   }
+   fclose(file);
+   return count;
+}
+
+static gateScenario* findScenario(gateScenario* scenarios, int count, const char* name){
+   for(int i = 0; i < count; ++i){
+      if(strcmp(scenarios[i].name, name) == 0){
+         return &scenarios[i];
+      }
+   }
+   return NULL;
+}
+
+static int findMetric(const char* name){
+   for(int m = 0; m < METRIC_COUNT; ++m){
+      if(strcmp(metricNames[m], name) == 0){
+         return m;
+      }
+   }
+   return -1;
+}
+
+// Baseline lines: "scenario metric ms ms ms ...", one value per run.
+// Returns -1 if there is no baseline file.
+static int readBaseline(const char* path, gateScenario* scenarios, int count){
+   FILE* file = fopen(path, "r");
+   if(!file){
+      return -1;
+   }
+   char line[16 * TEXT];
+   while(fgets(line, sizeof(line), file)){
+      char name[64], metricName[64];
+      int offset = 0;
+      if(line[0] == '#' || sscanf(line, "%63s %63s %n", name, metricName, &offset) < 2){
+         continue;
+      }
+      gateScenario* s = findScenario(scenarios, count, name);
+      int metric = findMetric(metricName);
+      if(!s || metric < 0){
+         continue;
+      }
+      int runs = 0;
+      char* cursor = line + offset;
+      char* end;
+      for(double value = strtod(cursor, &end); end != cursor && runs < MAX_RUNS;
+          value = strtod(cursor, &end)){
+         s->baseline[metric][runs++] = value;
+         cursor = end;
+      }
+      s->baselineRuns = s->baselineRuns == 0 || runs < s->baselineRuns ? runs : s->baselineRuns;
+   }
+   fclose(file);
+   return 0;
+}
+
+// Keeps the baseline of scenarios not run this time, replaces the others
+static int writeBaseline(const char* path, const char* machine, gateScenario* scenarios,
+                         int count, int warmup){
+   FILE* file = fopen(path, "w");
+   if(!file){
+      return -1;
+   }
+   fprintf(file, "# perfgate baseline of %s, %d warmup frames dropped, ms per run\n", machine,
+      warmup);
+   for(int i = 0; i < count; ++i){
+      gateScenario* s = &scenarios[i];
+      int recorded = s->selected && !s->failed && s->runs > 0;
+      int runs = recorded ? s->runs : s->baselineRuns;
+      for(int m = 0; m < METRIC_COUNT && runs > 0; ++m){
+         fprintf(file, "%-20s %-13s", s->name, metricNames[m]);
+         for(int r = 0; r < runs; ++r){
+            fprintf(file, " %.3f", recorded ? s->values[m][r] : s->baseline[m][r]);
+         }
+         fprintf(file, "\n");
+      }
+   }
+   fclose(file);
+   return 0;
+}
+
+// Runs the command of s once in a fresh output directory and adds the
+// medians and p95s of its frames after warmup as the next run
+static int runScenario(gateScenario* s, int warmup){
+   char directory[] = "/tmp/perfgate.XXXXXX";
+   if(!mkdtemp(directory)){
+      printf("%s: could not create an output directory\n", s->name);
+      return -1;
+   }
+   // Command with {out} replaced, run in the scenario directory. The whole
+   // command line reads /dev/null, so a program that asks for input fails
+   // instead of waiting, and writes stderr into the pipe too.
+   char command[2 * TEXT];
+   int length = snprintf(command, sizeof(command), "exec </dev/null 2>&1; cd '%s' && ",
+      s->directory);
+   for(const char* c = s->command; *c && length + 32 < (int)sizeof(command); ){
+      if(strncmp(c, "{out}", 5) == 0){
+         length += snprintf(command + length, sizeof(command) - length, "%s", directory);
+         c += 5;
+      } else {
+         command[length++] = *c++;
+      }
+   }
+   command[length] = '\0';
+
+   static double physics[MAX_FRAMES], coloring[MAX_FRAMES], frames[MAX_FRAMES];
+   int frameCount = 0, done = 0;
+   char lastLine[TEXT] = "";
+   FILE* output = popen(command, "r");
+   if(output){
+      char line[TEXT];
+      while(fgets(line, sizeof(line), output)){
+         unsigned int frame, scenes;
+         double physicsMs, coloringMs;
+         if(sscanf(line, "Ensemble frame %u: %u scenes, satelite moving: %lfms, space coloring: %lfms",
+                   &frame, &scenes, &physicsMs, &coloringMs) == 4){
+            if((int)frame >= warmup && frameCount < MAX_FRAMES){
+               physics[frameCount] = physicsMs;
+               coloring[frameCount] = coloringMs;
+               frames[frameCount] = physicsMs + coloringMs;
+               ++frameCount;
+            }
+         } else if(strncmp(line, "Ensemble done", 13) == 0){
+            done = 1;
+         } else {
+            snprintf(lastLine, sizeof(lastLine), "%s", line);
+         }
+      }
+   }
+   int status = output ? pclose(output) : -1;
+   char remove[TEXT];
+   snprintf(remove, sizeof(remove), "rm -rf '%s'", directory);
+   if(system(remove) != 0){
+      printf("%s: could not remove %s\n", s->name, directory);
+   }
+
+   if(status != 0 || !done || frameCount == 0){
+      printf("%s: failed (exit status %d, %d frames after warmup)%s%s", s->name, status,
+         frameCount, lastLine[0] ? ", last output: " : "\n", lastLine);
+      return -1;
+   }
+   int r = s->runs++;
+   s->values[METRIC_FRAME_P50][r] = percentile(frames, frameCount, 0.5);
+   s->values[METRIC_FRAME_P95][r] = percentile(frames, frameCount, 0.95);
+   s->values[METRIC_PHYSICS_P50][r] = percentile(physics, frameCount, 0.5);
+   s->values[METRIC_PHYSICS_P95][r] = percentile(physics, frameCount, 0.95);
+   s->values[METRIC_COLORING_P50][r] = percentile(coloring, frameCount, 0.5);
+   s->values[METRIC_COLORING_P95][r] = percentile(coloring, frameCount, 0.95);
+   return 0;
+}
+
+int main(int argc, char** argv){
+   const char* scenariosPath = optionValue(argc, argv, "scenarios");
+   const char* baselineDirectory = optionValue(argc, argv, "baselines");
+   scenariosPath = scenariosPath ? scenariosPath : "perf/scenarios.txt";
+   baselineDirectory = baselineDirectory ? baselineDirectory : "perf/baselines";
+   char machine[256];
+   if(optionValue(argc, argv, "machine")){
+      snprintf(machine, sizeof(machine), "%s", optionValue(argc, argv, "machine"));
+   } else {
+      machineClass(machine, sizeof(machine));
+   }
+   int record = optionFlag(argc, argv, "record");
+   int runs = (int)optionLong(argc, argv, "runs", record ? 9 : 5);
+   runs = runs < 1 ? 1 : runs > MAX_RUNS ? MAX_RUNS : runs;
+   int warmup = (int)optionLong(argc, argv, "warmup", 2);
+   const char* value = optionValue(argc, argv, "threshold");
+   double threshold = (value ? atof(value) : 5.0) / 100.0;
+   value = optionValue(argc, argv, "threshold-p95");
+   double thresholdP95 = (value ? atof(value) : 10.0) / 100.0;
+   value = optionValue(argc, argv, "alpha");
+   double alpha = value ? atof(value) : 0.01;
+
+   static gateScenario scenarios[MAX_SCENARIOS];
+   int count = readScenarios(scenariosPath, scenarios);
+   if(count <= 0){
+      printf("No scenarios in %s\n", scenariosPath);
+      return EXIT_SETUP;
+   }
+   const char* only = optionValue(argc, argv, "only");
+   if(only){
+      char list[TEXT];
+      snprintf(list, sizeof(list), ",%s,", only);
+      for(int i = 0; i < count; ++i){
+         char name[72];
+         snprintf(name, sizeof(name), ",%.63s,", scenarios[i].name);
+         scenarios[i].selected = strstr(list, name) != NULL;
+      }
+   }
+
+   char baselinePath[TEXT];
+   snprintf(baselinePath, sizeof(baselinePath), "%s/%s.txt", baselineDirectory, machine);
+   int haveBaseline = readBaseline(baselinePath, scenarios, count) == 0;
+   if(!record && !haveBaseline){
+      printf("No baseline for machine class %s (%s), record one with --record\n", machine,
+         baselinePath);
+      return EXIT_SETUP;
+   }
+   printf("Machine class %s, %d runs per scenario, %s %s\n", machine, runs,
+      record ? "recording" : "comparing with", baselinePath);
+
+   // Run r of every scenario before run r + 1 of any
+   for(int r = 0; r < runs; ++r){
+      for(int i = 0; i < count; ++i){
+         gateScenario* s = &scenarios[i];
+         if(!s->selected || s->failed || (!record && s->baselineRuns == 0)){
+            continue;
+         }
+         s->failed = runScenario(s, warmup) != 0;
+         if(!s->failed){
+            printf("run %d/%d %-20s frame p50 %9.1f ms  p95 %9.1f ms\n", r + 1, runs, s->name,
+               s->values[METRIC_FRAME_P50][s->runs - 1], s->values[METRIC_FRAME_P95][s->runs - 1]);
+         }
+      }
+   }
+
+   int failures = 0;
+   for(int i = 0; i < count; ++i){
+      failures += scenarios[i].selected && scenarios[i].failed;
+   }
+   if(record){
+      if(writeBaseline(baselinePath, machine, scenarios, count, warmup) != 0){
+         printf("Could not write %s\n", baselinePath);
+         return EXIT_SETUP;
+      }
+      printf("Baseline written to %s%s\n", baselinePath,
+         failures ? ", without the scenarios that failed" : "");
+      return failures ? EXIT_SETUP : EXIT_SUCCESS;
+   }
+
+   FILE* csv = NULL;
+   const char* csvPath = optionValue(argc, argv, "csv");
+   if(csvPath){
+      csv = fopen(csvPath, "w");
+      if(!csv){
+         printf("Could not write %s\n", csvPath);
+         return EXIT_SETUP;
+      }
+      fprintf(csv, "scenario,metric,baseline_runs,runs,baseline_ms,current_ms,change,"
+         "baseline_spread,p_value,status\n");
+   }
+
+   int regressions = 0, warned = 0;
+   printf("\n%-20s %-13s %11s %11s %8s %7s %8s  %s\n", "scenario", "metric", "baseline ms",
+      "current ms", "change", "spread", "p", "status");
+   for(int i = 0; i < count; ++i){
+      gateScenario* s = &scenarios[i];
+      if(!s->selected){
+         continue;
+      }
+      if(s->baselineRuns == 0){
+         printf("%-20s no baseline, not compared\n", s->name);
+         continue;
+      }
+      if(s->failed){
+         continue;
+      }
+      if(!warned && mannWhitneyFloor(s->baselineRuns, s->runs) > alpha){
+         printf("(%d against %d runs can not reach p < %g, use more --runs)\n", s->baselineRuns,
+            s->runs, alpha);
+         warned = 1;
+      }
+      for(int m = 0; m < METRIC_COUNT; ++m){
+         double base = percentile(s->baseline[m], s->baselineRuns, 0.5);
+         double current = percentile(s->values[m], s->runs, 0.5);
+         double change = base > 0 ? current / base - 1.0 : 0.0;
+         // Spread of the baseline runs: interquartile range over the median
+         double spread = base > 0 ? (percentile(s->baseline[m], s->baselineRuns, 0.75) -
+                                     percentile(s->baseline[m], s->baselineRuns, 0.25)) / base : 0.0;
+         double limit = (m % 2 == 0) ? threshold : thresholdP95;
+         double p = mannWhitneyP(s->baseline[m], s->baselineRuns, s->values[m], s->runs, change > 0);
+         const char* status = "ok";
+         if(change > limit){
+            status = p < alpha ? "REGRESSION" : "noise";
+            regressions += p < alpha;
+         } else if(change < -limit && p < alpha){
+            status = "faster";
+         }
+         printf("%-20s %-13s %11.2f %11.2f %+7.1f%% %6.1f%% %8.4f  %s\n", s->name, metricNames[m],
+            base, current, 100.0 * change, 100.0 * spread, p, status);
+         if(csv){
+            fprintf(csv, "%s,%s,%d,%d,%.3f,%.3f,%.4f,%.4f,%.6f,%s\n", s->name, metricNames[m],
+               s->baselineRuns, s->runs, base, current, change, spread, p, status);
+         }
+      }
+   }
+   if(csv){
+      fclose(csv);
+   }
+
+   if(failures){
+      printf("\n%d scenarios failed to run\n", failures);
+   }
+   printf("%d significant regressions (median over %.0f%%, p95 over %.0f%%, p < %g)\n",
+      regressions, 100.0 * threshold, 100.0 * thresholdP95, alpha);
+   return regressions ? EXIT_REGRESSION : failures ? EXIT_SETUP : EXIT_SUCCESS;
+}
@@ -0,0 +1,572 @@
+// CPU memory bandwidth harness: the SAXPY of hello.cu and the STREAM
+// copy, scale, add and triad kernels, without CUDA hardware.
+//
+// Compilation on linux:
+//   gcc -o streambench streambench.c -std=c99 -O2 -march=native -fopenmp
+// with the OpenCL variant on a CPU device:
+//   gcc -o streambench streambench.c -std=c99 -O2 -march=native -fopenmp -DWITH_OPENCL -lOpenCL
+// Usage:
+//   ./streambench [--variants=scalar,omp,simd,opencl] [--threads=1,2,4]
+//                 [--sizes=1024,16384,131072,1048576,8388608] [--repeat=5] [--csv=path]
+//
+// Every kernel runs over float arrays a, b and c of each size (elements
+// per array, from L1 resident to DRAM resident, 1<<20 is the SAXPY of
+// hello.cu), with each thread count, in each variant:
+//   scalar  plain loops the compiler may not vectorize
+//   omp     loops with #pragma omp simd, vectorized by the compiler
+//   simd    AVX, SSE2 or NEON intrinsics, whichever the build targets
+//   opencl  the kernels on the CPU device, a sub-device of that many
+//           compute units per thread count (with -DWITH_OPENCL)
+// Threads split the arrays in contiguous blocks, and the arrays are first
+// touched that way, so pages land on the node of the thread using them.
+// A measurement repeats the kernel until about ITERATION_BYTES moved and
+// keeps the best of --repeat such runs. Every pass includes the fork and
+// join of the thread team, like a frame of the engines does, which shows
+// in the cache resident sizes. Bytes count what a kernel reads and writes
+// (STREAM counting, without write allocate traffic).
+//
+// The report ends with the attainable bandwidth per size, the best of
+// every kernel, variant and thread count: the ceiling the color pass of
+// the engines is judged against.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <omp.h>
+
+#include "common/options.h"
+#include "common/clock.h"
+#include "common/alloc.h"
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#define SIMD_NAME "avx"
+#define SIMD_WIDTH 8
+typedef __m256 simdFloat;
+#define simdLoad _mm256_loadu_ps
+#define simdStore _mm256_storeu_ps
+#define simdSet _mm256_set1_ps
+#define simdAdd _mm256_add_ps
+#define simdMul _mm256_mul_ps
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define SIMD_NAME "sse2"
+#define SIMD_WIDTH 4
+typedef __m128 simdFloat;
+#define simdLoad _mm_loadu_ps
+#define simdStore _mm_storeu_ps
+#define simdSet _mm_set1_ps
+#define simdAdd _mm_add_ps
+#define simdMul _mm_mul_ps
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define SIMD_NAME "neon"
+#define SIMD_WIDTH 4
+typedef float32x4_t simdFloat;
+#define simdLoad vld1q_f32
+#define simdStore vst1q_f32
+#define simdSet vdupq_n_f32
+#define simdAdd vaddq_f32
+#define simdMul vmulq_f32
+#endif
+
+#ifdef WITH_OPENCL
+#define CL_TARGET_OPENCL_VERSION 200
+#define CL_USE_DEPRECATED_OPENCL_1_2_APIS
+#ifdef __APPLE__
+#include <OpenCL/opencl.h>
+#else
+#include <CL/cl.h>
+#endif
+#include "common/cl_probe.h"
+#endif
+
+// The scalar variant must stay scalar even at -O3
+#if defined(__GNUC__) && !defined(__clang__)
+#define SCALAR_LOOPS __attribute__((optimize("no-tree-vectorize")))
+#else
+#define SCALAR_LOOPS
+#endif
+
+// Bytes a measurement moves at least, so L1 sized arrays run long enough
+#define ITERATION_BYTES (64u << 20)
+#define MAX_LIST 32
+#define SCALE 2.0f
+
+typedef enum{
+   KERNEL_SAXPY,                    // b = s * a + b
+   KERNEL_COPY,                     // c = a
+   KERNEL_SCALE,                    // b = s * c
+   KERNEL_ADD,                      // c = a + b
+   KERNEL_TRIAD,                    // a = b + s * c
+   KERNEL_COUNT
+} benchKernel;
+
+static const char* const kernelNames[KERNEL_COUNT] = {"saxpy", "copy", "scale", "add", "triad"};
+// Floats read and written per element
+static const int kernelFloats[KERNEL_COUNT] = {3, 2, 2, 3, 3};
+
+typedef enum{
+   VARIANT_SCALAR,
+   VARIANT_OMP,
+   VARIANT_SIMD,
+   VARIANT_OPENCL,
+   VARIANT_COUNT
+} benchVariant;
+
+static const char* const variantNames[VARIANT_COUNT] = {"scalar", "omp", "simd", "opencl"};
+
+typedef struct{
+   float* a;
+   float* b;
+   float* c;
+   size_t capacity;                 // elements per array
+} benchArrays;
+
+// Best result per size, for the ceiling
+typedef struct{
+   double gbPerSecond;
+   benchKernel kernel;
+   benchVariant variant;
+   int threads;
+} benchCeiling;
+
+SCALAR_LOOPS
+static void scalarRange(benchKernel kernel, float* restrict a, float* restrict b,
+                        float* restrict c, size_t begin, size_t end){
+   switch(kernel){
+   case KERNEL_SAXPY: for(size_t i = begin; i < end; ++i) b[i] = SCALE * a[i] + b[i]; break;
+   case KERNEL_COPY:  for(size_t i = begin; i < end; ++i) c[i] = a[i]; break;
+   case KERNEL_SCALE: for(size_t i = begin; i < end; ++i) b[i] = SCALE * c[i]; break;
+   case KERNEL_ADD:   for(size_t i = begin; i < end; ++i) c[i] = a[i] + b[i]; break;
+   case KERNEL_TRIAD: for(size_t i = begin; i < end; ++i) a[i] = b[i] + SCALE * c[i]; break;
+   default: break;
+   }
+}
+
+static void vectorRange(benchKernel kernel, float* restrict a, float* restrict b,
+                        float* restrict c, size_t begin, size_t end){
+   switch(kernel){
+   case KERNEL_SAXPY:
+      #pragma omp simd
+      for(size_t i = begin; i < end; ++i) b[i] = SCALE * a[i] + b[i];
+      break;
+   case KERNEL_COPY:
+      #pragma omp simd
+      for(size_t i = begin; i < end; ++i) c[i] = a[i];
+      break;
+   case KERNEL_SCALE:
+      #pragma omp simd
+      for(size_t i = begin; i < end; ++i) b[i] = SCALE * c[i];
+      break;
+   case KERNEL_ADD:
+      #pragma omp simd
+      for(size_t i = begin; i < end; ++i) c[i] = a[i] + b[i];
+      break;
+   case KERNEL_TRIAD:
+      #pragma omp simd
+      for(size_t i = begin; i < end; ++i) a[i] = b[i] + SCALE * c[i];
+      break;
+   default:
+      break;
+   }
+}
+
+#ifdef SIMD_NAME
+// Whole vectors with intrinsics, the rest with the scalar loop
+static void simdRange(benchKernel kernel, float* restrict a, float* restrict b,
+                      float* restrict c, size_t begin, size_t end){
+   const simdFloat s = simdSet(SCALE);
+   size_t i = begin;
+   size_t last = end - (end - begin) % SIMD_WIDTH;
+   switch(kernel){
+   case KERNEL_SAXPY:
+      for(; i < last; i += SIMD_WIDTH) simdStore(b + i, simdAdd(simdMul(s, simdLoad(a + i)), simdLoad(b + i)));
+      break;
+   case KERNEL_COPY:
+      for(; i < last; i += SIMD_WIDTH) simdStore(c + i, simdLoad(a + i));
+      break;
+   case KERNEL_SCALE:
+      for(; i < last; i += SIMD_WIDTH) simdStore(b + i, simdMul(s, simdLoad(c + i)));
+      break;
+   case KERNEL_ADD:
+      for(; i < last; i += SIMD_WIDTH) simdStore(c + i, simdAdd(simdLoad(a + i), simdLoad(b + i)));
+      break;
+   case KERNEL_TRIAD:
+      for(; i < last; i += SIMD_WIDTH) simdStore(a + i, simdAdd(simdLoad(b + i), simdMul(s, simdLoad(c + i))));
+      break;
+   default:
+      break;
+   }
+   scalarRange(kernel, a, b, c, i, end);
+}
+#endif
+
+// One pass of kernel over n elements with threads, each on its own block
+static void runHost(benchVariant variant, benchKernel kernel, benchArrays* arrays, size_t n,
+                    int threads){
+   #pragma omp parallel num_threads(threads)
+   {
+      int t = omp_get_thread_num();
+      int count = omp_get_num_threads();
+      size_t begin = n * t / count;
+      size_t end = n * (t + 1) / count;
+      if(variant == VARIANT_SCALAR){
+         scalarRange(kernel, arrays->a, arrays->b, arrays->c, begin, end);
+#ifdef SIMD_NAME
+      } else if(variant == VARIANT_SIMD){
+         simdRange(kernel, arrays->a, arrays->b, arrays->c, begin, end);
+#endif
+      } else {
+         vectorRange(kernel, arrays->a, arrays->b, arrays->c, begin, end);
+      }
+   }
+}
+
+// Sets the arrays like hello.cu does (a = 1, b = 2) and c = 0, with the
+// block of each thread written by that thread
+static void fillArrays(benchArrays* arrays, size_t n, int threads){
+   #pragma omp parallel num_threads(threads)
+   {
+      int t = omp_get_thread_num();
+      int count = omp_get_num_threads();
+      for(size_t i = n * t / count; i < n * (t + 1) / count; ++i){
+         arrays->a[i] = 1.0f;
+         arrays->b[i] = 2.0f;
+         arrays->c[i] = 0.0f;
+      }
+   }
+}
+
+// Largest error of b after one SAXPY from fillArrays(), hello.cu expects 4
+static float saxpyError(const benchArrays* arrays, size_t n){
+   float maxError = 0.0f;
+   for(size_t i = 0; i < n; i++){
+      maxError = fmaxf(maxError, fabsf(arrays->b[i] - 4.0f));
+   }
+   return maxError;
+}
+
+#ifdef WITH_OPENCL
+static const char* streamSource =
+   "__kernel void saxpy(__global float* a, __global float* b, __global float* c, float s){\n"
+   "   size_t i = get_global_id(0); b[i] = s * a[i] + b[i];\n"
+   "}\n"
+   "__kernel void copy(__global float* a, __global float* b, __global float* c, float s){\n"
+   "   size_t i = get_global_id(0); c[i] = a[i];\n"
+   "}\n"
+   "__kernel void scale(__global float* a, __global float* b, __global float* c, float s){\n"
+   "   size_t i = get_global_id(0); b[i] = s * c[i];\n"
+   "}\n"
+   "__kernel void add(__global float* a, __global float* b, __global float* c, float s){\n"
+   "   size_t i = get_global_id(0); c[i] = a[i] + b[i];\n"
+   "}\n"
+   "__kernel void triad(__global float* a, __global float* b, __global float* c, float s){\n"
+   "   size_t i = get_global_id(0); a[i] = b[i] + s * c[i];\n"
+   "}\n";
+
+// The CPU device, or a sub-device of it, with the kernels bound to the
+// host arrays (CL_MEM_USE_HOST_PTR, so no copies on a CPU device)
+typedef struct{
+   cl_device_id device;
+   int subDevice;
+   cl_context context;
+   cl_command_queue queue;
+   cl_program program;
+   cl_kernel kernels[KERNEL_COUNT];
+   cl_mem buffers[3];
+} clEngine;
+
+static void clEngineRelease(clEngine* engine){
+   for(int k = 0; k < KERNEL_COUNT; ++k){
+      if(engine->kernels[k]){
+         clReleaseKernel(engine->kernels[k]);
+      }
+   }
+   for(int m = 0; m < 3; ++m){
+      if(engine->buffers[m]){
+         clReleaseMemObject(engine->buffers[m]);
+      }
+   }
+   if(engine->program){
+      clReleaseProgram(engine->program);
+   }
+   if(engine->queue){
+      clReleaseCommandQueue(engine->queue);
+   }
+   if(engine->context){
+      clReleaseContext(engine->context);
+   }
+   if(engine->subDevice){
+      clReleaseDevice(engine->device);
+   }
+   memset(engine, 0, sizeof(*engine));
+}
+
+// Sets up the CPU device with threads compute units. Returns 0 on success.
+static int clEngineCreate(clEngine* engine, const clDeviceRecord* cpu, int threads,
+                          benchArrays* arrays){
+   memset(engine, 0, sizeof(*engine));
+   engine->device = cpu->device;
+   if((cl_uint)threads > cpu->computeUnits){
+      return -1;
+   }
+   if((cl_uint)threads < cpu->computeUnits){
+      const cl_device_partition_property counts[4] = {
+         CL_DEVICE_PARTITION_BY_COUNTS, threads, CL_DEVICE_PARTITION_BY_COUNTS_LIST_END, 0
+      };
+      cl_uint created = 0;
+      if(clCreateSubDevices(cpu->device, counts, 1, &engine->device, &created) != CL_SUCCESS ||
+         created != 1){
+         return -1;
+      }
+      engine->subDevice = 1;
+   }
+   cl_int status;
+   engine->context = clCreateContext(NULL, 1, &engine->device, NULL, NULL, &status);
+   if(status == CL_SUCCESS){
+      engine->queue = clCreateCommandQueue(engine->context, engine->device, 0, &status);
+   }
+   float* host[3] = {arrays->a, arrays->b, arrays->c};
+   for(int m = 0; m < 3 && status == CL_SUCCESS; ++m){
+      engine->buffers[m] = clCreateBuffer(engine->context, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR,
+         arrays->capacity * sizeof(float), host[m], &status);
+   }
+   if(status == CL_SUCCESS){
+      engine->program = clCreateProgramWithSource(engine->context, 1, &streamSource, NULL, &status);
+   }
+   if(status == CL_SUCCESS){
+      status = clBuildProgram(engine->program, 1, &engine->device, "-cl-fast-relaxed-math",
+         NULL, NULL);
+   }
+   float s = SCALE;
+   for(int k = 0; k < KERNEL_COUNT && status == CL_SUCCESS; ++k){
+      engine->kernels[k] = clCreateKernel(engine->program, kernelNames[k], &status);
+      for(int m = 0; m < 3 && status == CL_SUCCESS; ++m){
+         status = clSetKernelArg(engine->kernels[k], m, sizeof(cl_mem), &engine->buffers[m]);
+      }
+      if(status == CL_SUCCESS){
+         status = clSetKernelArg(engine->kernels[k], 3, sizeof(float), &s);
+      }
+   }
+   if(status != CL_SUCCESS){
+      clEngineRelease(engine);
+      return -1;
+   }
+   return 0;
+}
+
+// One pass of kernel over n elements
+static int runOpenCL(clEngine* engine, benchKernel kernel, size_t n){
+   cl_int status = clEnqueueNDRangeKernel(engine->queue, engine->kernels[kernel], 1, NULL, &n,
+      NULL, 0, NULL, NULL);
+   status |= clFinish(engine->queue);
+   return status == CL_SUCCESS ? 0 : -1;
+}
+
+// Maps and unmaps b, which makes the device's writes visible to the host
+static void clEngineSync(clEngine* engine, size_t n){
+   cl_int status;
+   void* mapped = clEnqueueMapBuffer(engine->queue, engine->buffers[1], CL_TRUE, CL_MAP_READ, 0,
+      n * sizeof(float), 0, NULL, NULL, &status);
+   if(status == CL_SUCCESS){
+      clEnqueueUnmapMemObject(engine->queue, engine->buffers[1], mapped, 0, NULL, NULL);
+      clFinish(engine->queue);
+   }
+}
+#endif
+
+// One pass of kernel in variant, engine is the clEngine of the opencl one
+static void runKernel(benchVariant variant, benchKernel kernel, benchArrays* arrays, size_t n,
+                      int threads, void* engine){
+#ifdef WITH_OPENCL
+   if(variant == VARIANT_OPENCL){
+      runOpenCL((clEngine*)engine, kernel, n);
+      return;
+   }
+#else
+   (void)engine;
+#endif
+   runHost(variant, kernel, arrays, n, threads);
+}
+
+// Parses a list like "1,2,4" into values. Returns the count.
+static int parseList(const char* text, long* values){
+   int count = 0;
+   while(text && *text && count < MAX_LIST){
+      char* end;
+      values[count] = strtol(text, &end, 0);
+      if(end == text || values[count] <= 0){
+         return -1;
+      }
+      count++;
+      text = *end == ',' ? end + 1 : end;
+      if(*end != ',' && *end != '\0'){
+         return -1;
+      }
+   }
+   return count;
+}
+
+int main(int argc, char** argv){
+   long sizes[MAX_LIST] = {1 << 10, 1 << 14, 1 << 17, 1 << 20, 1 << 23};
+   int sizeCount = 5;
+   long threads[MAX_LIST];
+   int threadCount = 0;
+   int maxThreads = omp_get_max_threads();
+   for(long t = 1; t < maxThreads && threadCount < MAX_LIST - 1; t *= 2){
+      threads[threadCount++] = t;
+   }
+   threads[threadCount++] = maxThreads;
+   if(optionValue(argc, argv, "sizes")){
+      sizeCount = parseList(optionValue(argc, argv, "sizes"), sizes);
+   }
+   if(optionValue(argc, argv, "threads")){
+      threadCount = parseList(optionValue(argc, argv, "threads"), threads);
+   }
+   if(sizeCount <= 0 || threadCount <= 0){
+      printf("--sizes and --threads take positive numbers like 1024,1048576\n");
+      return EXIT_FAILURE;
+   }
+   int repeat = (int)optionLong(argc, argv, "repeat", 5);
+   repeat = repeat > 0 ? repeat : 1;
+
+   int enabled[VARIANT_COUNT] = {1, 1, 1, 1};
+   const char* variants = optionValue(argc, argv, "variants");
+   if(variants){
+      for(int v = 0; v < VARIANT_COUNT; ++v){
+         enabled[v] = strstr(variants, variantNames[v]) != NULL;
+      }
+   }
+#ifndef SIMD_NAME
+   if(enabled[VARIANT_SIMD]){
+      printf("simd: no AVX, SSE2 or NEON in this build, skipped\n");
+   }
+   enabled[VARIANT_SIMD] = 0;
+#endif
+
+   FILE* csv = NULL;
+   const char* csvPath = optionValue(argc, argv, "csv");
+   if(csvPath){
+      csv = fopen(csvPath, "w");
+      if(!csv){
+         printf("Could not write %s\n", csvPath);
+         return EXIT_FAILURE;
+      }
+      fprintf(csv, "variant,threads,elements,kernel,bytes,seconds,gb_per_second\n");
+   }
+
+   benchArrays arrays = {.capacity = 0};
+   for(int s = 0; s < sizeCount; ++s){
+      arrays.capacity = (size_t)sizes[s] > arrays.capacity ? (size_t)sizes[s] : arrays.capacity;
+   }
+   size_t arrayBytes = arrays.capacity * sizeof(float);
+   arrays.a = (float*)alignedAllocate(arrayBytes, ALLOC_PAGE);
+   arrays.b = (float*)alignedAllocate(arrayBytes, ALLOC_PAGE);
+   arrays.c = (float*)alignedAllocate(arrayBytes, ALLOC_PAGE);
+   if(!arrays.a || !arrays.b || !arrays.c){
+      printf("Could not allocate 3 x %zu bytes\n", arrayBytes);
+      return EXIT_FAILURE;
+   }
+   fillArrays(&arrays, arrays.capacity, maxThreads);
+
+#ifdef WITH_OPENCL
+   static clProbe probe;
+   clProbeDevices(&probe);
+   const clDeviceRecord* cpu = clProbePick(&probe, CL_DEVICE_TYPE_CPU, 0);
+   if(enabled[VARIANT_OPENCL] && !cpu){
+      printf("opencl: no CPU device, skipped\n");
+   }
+   enabled[VARIANT_OPENCL] = enabled[VARIANT_OPENCL] && cpu;
+#else
+   if(variants && enabled[VARIANT_OPENCL]){
+      printf("opencl: build with -DWITH_OPENCL -lOpenCL, skipped\n");
+   }
+   enabled[VARIANT_OPENCL] = 0;
+#endif
+
+   benchCeiling ceilings[MAX_LIST];
+   memset(ceilings, 0, sizeof(ceilings));
+   printf("%-7s %7s %10s %6s %12s %10s\n", "variant", "threads", "elements", "kernel", "bytes", "GB/s");
+   for(int v = 0; v < VARIANT_COUNT; ++v){
+      if(!enabled[v]){
+         continue;
+      }
+      for(int t = 0; t < threadCount; ++t){
+         void* engine = NULL;
+#ifdef WITH_OPENCL
+         clEngine openclEngine;
+         if(v == VARIANT_OPENCL){
+            if(clEngineCreate(&openclEngine, cpu, (int)threads[t], &arrays) != 0){
+               printf("opencl: no sub-device of %ld compute units, skipped\n", threads[t]);
+               continue;
+            }
+            engine = &openclEngine;
+         }
+#endif
+         // hello.cu's check: one SAXPY of a = 1, b = 2 gives b = 4
+         size_t checkSize = arrays.capacity;
+         fillArrays(&arrays, checkSize, (int)threads[t]);
+         runKernel((benchVariant)v, KERNEL_SAXPY, &arrays, checkSize, (int)threads[t], engine);
+#ifdef WITH_OPENCL
+         if(engine){
+            clEngineSync(engine, checkSize);
+         }
+#endif
+         float maxError = saxpyError(&arrays, checkSize);
+         if(maxError != 0.0f){
+            printf("%s with %ld threads: SAXPY max error %f\n", variantNames[v], threads[t], maxError);
+         }
+
+         for(int s = 0; s < sizeCount; ++s){
+            size_t n = (size_t)sizes[s];
+            for(int k = 0; k < KERNEL_COUNT; ++k){
+               size_t bytes = n * kernelFloats[k] * sizeof(float);
+               size_t iterations = ITERATION_BYTES / bytes > 0 ? ITERATION_BYTES / bytes : 1;
+               double best = -1;
+               for(int r = 0; r < repeat; ++r){
+                  uint64_t start = nowNanoseconds();
+                  for(size_t i = 0; i < iterations; ++i){
+                     runKernel((benchVariant)v, (benchKernel)k, &arrays, n, (int)threads[t], engine);
+                  }
+                  double seconds = (nowNanoseconds() - start) * 1e-9 / iterations;
+                  best = best < 0 || seconds < best ? seconds : best;
+               }
+               double gbPerSecond = bytes / best * 1e-9;
+               printf("%-7s %7ld %10zu %6s %12zu %10.2f\n", variantNames[v], threads[t], n,
+                  kernelNames[k], bytes, gbPerSecond);
+               if(csv){
+                  fprintf(csv, "%s,%ld,%zu,%s,%zu,%.9f,%.3f\n", variantNames[v], threads[t], n,
+                     kernelNames[k], bytes, best, gbPerSecond);
+               }
+               if(gbPerSecond > ceilings[s].gbPerSecond){
+                  ceilings[s] = (benchCeiling){gbPerSecond, (benchKernel)k, (benchVariant)v,
+                     (int)threads[t]};
+               }
+            }
+         }
+#ifdef WITH_OPENCL
+         if(engine){
+            clEngineRelease(engine);
+         }
+#endif
+      }
+   }
+
+   printf("\nAttainable bandwidth (best kernel, variant and thread count per size):\n");
+   for(int s = 0; s < sizeCount; ++s){
+      const benchCeiling* c = &ceilings[s];
+      printf("  %10ld elements (3 arrays, %8.1f KB): %8.2f GB/s  %s %s %d threads\n", sizes[s],
+         3.0 * sizes[s] * sizeof(float) / 1024, c->gbPerSecond, kernelNames[c->kernel],
+         variantNames[c->variant], c->threads);
+   }
+
+   if(csv){
+      fclose(csv);
+   }
+   alignedFree(arrays.a, arrayBytes);
+   alignedFree(arrays.b, arrayBytes);
+   alignedFree(arrays.c, arrayBytes);
+   return EXIT_SUCCESS;
+}